@@ -27,9 +27,10 @@
 */
 
 #define _BSD_SOURCE
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200112L
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <curie/multiplex.h>
 #include <curie/network.h>
@@ -46,18 +47,32 @@
 #include <syscall/syscall.h>
 
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
 #include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #define HELPTEXT\
         dnsfs_version_long "\n"\
-        "Usage: dnsfs [-ofih] [-s socket-name]\n"\
+        "Usage: dnsfs [-ofith] [-s socket-name] [-r resolver]... [-b port]\n"\
         "\n"\
         " -o          Talk 9p on stdio\n"\
         " -s          Talk 9p on the supplied socket-name\n"\
+        " -r          Query the supplied resolver; may be repeated\n"\
         " -h          Print this and exit.\n"\
         " -f          Don't detach and creep into the background.\n"\
+        " -t          Also show cached names as a tree of labels under zones/,\n"\
+        "             e.g. zones/com/example/www/@/ip4.\n"\
+        " -b          Add a best file to each name that lists its addresses\n"\
+        "             ordered by how quickly they accept connections to port.\n"\
         "\n"\
         " socket-name The socket to use.\n"\
+        " resolver    An upstream resolver as address[:port] or [address]:port.\n"\
+        "             Without one, names are resolved with getaddrinfo(), so the\n"\
+        "             hosts file, nsswitch and the search list all apply.\n"\
         "\n"\
         "One of -s or -o must be specified.\n"\
         "\n"\
@@ -67,7 +82,30 @@
 static struct sexpr_io *queue;
 static struct io *queue_io;
 
-define_symbol (sym_disable, "disable");
+define_symbol (sym_disable,     "disable");
+define_symbol (sym_nop,         "nop");
+define_symbol (sym_invalidate,  "invalidate");
+define_symbol (sym_refresh,     "refresh");
+define_symbol (sym_flush,       "flush");
+define_symbol (sym_ttl_floor,   "ttl-floor");
+define_symbol (sym_ttl_ceiling, "ttl-ceiling");
+define_symbol (sym_cache_limit, "cache-limit");
+define_symbol (sym_cache_size,  "cache-size");
+define_symbol (sym_prefetch,    "prefetch");
+define_symbol (sym_serve_stale, "serve-stale");
+define_symbol (sym_upstreams,   "upstreams");
+define_symbol (sym_last,        "last-command");
+define_symbol (sym_ok,          "ok");
+define_symbol (sym_error,       "error");
+define_symbol (sym_entry,       "entry");
+define_symbol (sym_trace_sample, "trace-sample");
+define_symbol (sym_imported,    "imported");
+define_symbol (sym_import_rejected, "import-rejected");
+
+static void dnsfs_fid_set (struct d9r_io *, int_32, void *);
+static struct dfs_file *dnsfs_mk_file
+    (struct dfs_directory *, char *, int_8 *, int_64, void *,
+     void (*)(struct d9r_io *, int_16, struct dfs_file *, int_64, int_32));
 
 static void Tattach (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
                      char *uname, char *aname)
@@ -79,13 +117,29 @@ static void Tattach (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
     if (md != (struct d9r_fid_metadata *)0)
     {
         md->aux = fs->root;
+        dnsfs_fid_set (io, fid, md->aux);
     }
 
     d9r_reply_attach (io, tag, qid);
 }
 
-static void Twalk (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
-                   int_16 c, char **names)
+static char dnsfs_walk_defer
+    (struct d9r_io *, int_16, int_32, int_32, int_16, char **,
+     struct dfs_directory *);
+static struct tree_node *dnsfs_walk_lookup (struct dfs_directory *, char *);
+
+enum dnsfs_trace_op
+{
+    dt_walk,
+    dt_create,
+    dt_read
+};
+
+static void dnsfs_trace_begin (enum dnsfs_trace_op, int_16, const char *);
+static void dnsfs_trace_end ();
+
+static void dnsfs_walk (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
+                        int_16 c, char **names, char may_defer)
 {
     struct dfs *fs = io->aux;
     struct d9r_qid qid[c];
@@ -120,7 +174,7 @@ static void Twalk (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
                 }
             }
 
-            node = tree_get_node_string(d->nodes, names[i]);
+            node = dnsfs_walk_lookup (d, names[i]);
 
             if (node == (struct tree_node *)0)
             {
@@ -134,6 +188,12 @@ static void Twalk (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
                 return;
             }
 
+            if (may_defer && (d->c.type == dft_directory) &&
+                dnsfs_walk_defer (io, tag, fid, afid, c, names, d))
+            {
+                return;
+            }
+
             ret:
 
             qid[i].type    = 0;
@@ -156,6 +216,7 @@ static void Twalk (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
     {
         md = d9r_fid_metadata (io, afid);
         md->aux = d;
+        dnsfs_fid_set (io, afid, md->aux);
     }
     else
     {
@@ -166,6 +227,14 @@ static void Twalk (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
     d9r_reply_walk (io, tag, i, qid);
 }
 
+static void Twalk (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid,
+                   int_16 c, char **names)
+{
+    dnsfs_trace_begin (dt_walk, tag, (c > 0) ? names[c-1] : "");
+    dnsfs_walk (io, tag, fid, afid, c, names, 1);
+    dnsfs_trace_end ();
+}
+
 static void Tstat (struct d9r_io *io, int_16 tag, int_32 fid)
 {
     struct d9r_fid_metadata *md = d9r_fid_metadata (io, fid);
@@ -286,263 +355,3910 @@ static void Topen (struct d9r_io *io, int_16 tag, int_32 fid, int_8 mode)
     d9r_reply_open (io, tag, qid, 0x1000);
 }
 
-static void add_file_with_content
+static struct dfs_file *add_file_with_content
     (char *name, char *contents, unsigned long length,
      struct dfs_directory *d_dir)
 {
     struct dfs_file *d_ip4 =
-        dfs_mk_file (d_dir, name, (char *)0, (int_8 *)contents, length,
-	             (void *)0, (void *)0, (void *)0);
+        dnsfs_mk_file (d_dir, name, (int_8 *)contents, length, (void *)0,
+                       (void *)0);
 
     d_ip4->c.mode     = 0650;
     d_ip4->c.uid      = "dnsfs";
     d_ip4->c.gid      = "dnsfs";
+
+    return d_ip4;
 }
 
-define_symbol (sym_ip4,    "ip4");
-define_symbol (sym_ip6,    "ip6");
-define_symbol (sym_dgram,  "dgram");
-define_symbol (sym_stream, "stream");
-define_symbol (sym_any,    "any");
+define_symbol (sym_ip4,          "ip4");
+define_symbol (sym_ip6,          "ip6");
+define_symbol (sym_dgram,        "dgram");
+define_symbol (sym_stream,       "stream");
+define_symbol (sym_upstream,     "upstream");
+define_symbol (sym_srtt,         "srtt");
+define_symbol (sym_rttvar,       "rttvar");
+define_symbol (sym_failure_rate, "failure-rate");
+define_symbol (sym_healthy,      "healthy");
+define_symbol (sym_queries,      "queries");
+define_symbol (sym_answers,      "answers");
+define_symbol (sym_failures,     "failures");
+define_symbol (sym_hedges,       "hedges");
+define_symbol (sym_wins,         "wins");
+define_symbol (sym_window,       "window");
+define_symbol (sym_in_flight,    "in-flight");
+define_symbol (sym_interactive,  "interactive");
+define_symbol (sym_bulk,         "bulk");
+define_symbol (sym_depth,        "depth");
+define_symbol (sym_max_depth,    "max-depth");
+define_symbol (sym_wait,         "wait");
+define_symbol (sym_max_wait,     "max-wait");
+define_symbol (sym_dequeued,     "dequeued");
+define_symbol (sym_expired,      "expired");
+define_symbol (sym_rejected,     "rejected");
+define_symbol (sym_trace,        "trace");
+define_symbol (sym_walk,         "walk");
+define_symbol (sym_create,       "create");
+define_symbol (sym_read,         "read");
+define_symbol (sym_queue,        "queue");
+define_symbol (sym_resolver,     "resolver");
+define_symbol (sym_reply,        "reply");
+define_symbol (sym_pending,      "pending");
+
+/* all times are in microseconds on the monotonic clock */
+
+#define DNSFS_MAX_ADDRESSES  32
+#define DNSFS_MAX_ATTEMPTS   3
+#define DNSFS_PACKET_SIZE    1232
+#define DNSFS_NAME_SIZE      256
+#define DNSFS_LABEL_FILES    "@" /* a zone dir's link to its name's files */
+#define DNSFS_LOOKUP_TIMEOUT 3000000
+#define DNSFS_HEDGE_INITIAL  200000
+#define DNSFS_HEDGE_MIN      10000
+#define DNSFS_HEDGE_MAX      1000000
+#define DNSFS_UNHEALTHY      500
+#define DNSFS_HEALTH_RETRY   30000000
+#define DNSFS_DEFAULT_TTL    300
+#define DNSFS_NEGATIVE_TTL   60
+#define DNSFS_TTL_CEILING    86400
+#define DNSFS_CACHE_LIMIT    65536
+#define DNSFS_PREFETCH       10 /* refresh during the last tenth of a TTL */
+#define DNSFS_MAX_STALE      86400000000LL
+#define DNSFS_WINDOW         16
+#define DNSFS_MAX_QUEUED     1024
+#define DNSFS_QUEUE_TIMEOUT_INTERACTIVE 2000000
+#define DNSFS_QUEUE_TIMEOUT_BULK        10000000
+#define DNSFS_TRACE_SIZE     1024
+#define DNSFS_TRACE_NAME     64
+#define DNSFS_PROBE_TIMEOUT  1000000
+#define DNSFS_PROBE_INTERVAL 30000000 /* probe an address at most this often */
+#define DNSFS_PROBE_RATE     20       /* probes started per second */
+#define DNSFS_PROBE_PARALLEL 8
+#define DNSFS_PROBE_QUEUE    256
+#define DNSFS_PROBE_KEEP     600000000
+
+#define DNS_TYPE_A           1
+#define DNS_TYPE_AAAA        28
+#define DNS_RCODE_NXDOMAIN   3
+
+struct dnsfs_upstream
+{
+    struct dnsfs_upstream *next;
+    char                  *name;
+    struct sockaddr_storage address;
+    socklen_t              address_length;
+    int_32                 samples;
+    int_64                 srtt;
+    int_64                 rttvar;
+    int_32                 failrate; /* per mille, decaying */
+    int_64                 last_failure;
+    int_64                 queries;
+    int_64                 answers;
+    int_64                 failures;
+    int_64                 hedges;
+    int_64                 wins;
+};
 
-static void dnsfs_address_lookup (char *name, struct dfs_directory *d_dir)
+enum dnsfs_priority
 {
-    struct addrinfo *ai;
-    int r = getaddrinfo (name, (void *)0, (void *)0, &ai);
+    dp_interactive = 0,
+    dp_bulk        = 1
+};
 
-    if (r == 0)
+enum dnsfs_waiter_type
+{
+    dw_create,
+    dw_walk
+};
+
+struct dnsfs_waiter
+{
+    struct dnsfs_waiter   *next;
+    enum dnsfs_waiter_type type;
+    struct d9r_io         *io;
+    int_16                 tag;
+    int_32                 fid;
+    int_32                 afid;
+    int_16                 c;
+    char                 **names;
+    int_32                 trace;
+};
+
+struct dnsfs_entry
+{
+    char                 *name;
+    struct dfs_directory *dir;
+    struct dfs_file      *ip4;
+    struct dfs_file      *ip6;
+    struct dfs_file      *best;
+    struct dnsfs_lookup  *lookup;
+    struct dnsfs_label   *label;
+    struct dnsfs_entry   *lru_prev;
+    struct dnsfs_entry   *lru_next;
+    struct dnsfs_entry   *order_prev;
+    struct dnsfs_entry   *order_next;
+    unsigned int          n4;
+    unsigned int          n6;
+    unsigned char        *a4;
+    unsigned char        *a6;
+    int_32                ttl;
+    char                  resolved;
+    char                  flushed;
+    int_64                expires;
+};
+
+/* names are also kept in a trie of labels, read right to left, so that
+ * www.example.com and mail.example.com share the com and example nodes
+ * and a zone can be visited without looking at the rest of the cache;
+ * a label's dir links its name's dir as @, so files never hide labels */
+struct dnsfs_label
+{
+    struct dnsfs_label   *parent;
+    char                 *label;
+    struct tree          *children;
+    int_32                child_count;
+    struct dnsfs_entry   *entry;
+    struct dfs_directory *dir;
+};
+
+/* where a fid is in dnsfs/dump: entry is the next one to render, buffer
+ * holds rendered bytes from offset on that were not yet read */
+struct dnsfs_dump_cursor
+{
+    struct dnsfs_dump_cursor *next;
+    struct d9r_io            *io;
+    int_32                    fid;
+    struct dnsfs_entry       *entry;
+    int_64                    offset;
+    char                     *buffer;
+    unsigned int              length;
+};
+
+/* every attempt gets a socket of its own, so the kernel picks a fresh
+ * random source port for it */
+struct dnsfs_attempt
+{
+    struct dnsfs_upstream *upstream;
+    int                    fd;
+    int_64                 sent;
+    char                   answered;
+};
+
+/* one lookup asks for A and AAAA at once; every attempt sends the questions
+ * that are still open to another upstream, the first answer wins */
+struct dnsfs_lookup
+{
+    struct dnsfs_lookup  *next;
+    struct dnsfs_entry   *entry;
+    struct dnsfs_waiter  *waiters;
+    enum dnsfs_priority   priority;
+    char                  active;
+    int_64                queued;
+    int_64                queue_deadline;
+    int_32                id[2];
+    char                  done[2];
+    char                  answered;
+    int_32                ttl[2];
+    struct dnsfs_attempt  attempt[DNSFS_MAX_ATTEMPTS];
+    int                   attempts;
+    int_64                next_attempt;
+    int_64                deadline;
+    unsigned int          n4;
+    unsigned int          n6;
+    unsigned char         a4[DNSFS_MAX_ADDRESSES][4];
+    unsigned char         a6[DNSFS_MAX_ADDRESSES][16];
+};
+
+/* lookups waiting for a slot in the in-flight window, one FIFO per
+ * priority; interactive requests are always dispatched first */
+struct dnsfs_queue
+{
+    struct dnsfs_lookup *head;
+    struct dnsfs_lookup *tail;
+    int_64               timeout;
+    int_32               depth;
+    int_32               max_depth;
+    int_64               wait;
+    int_64               max_wait;
+    int_64               dequeued;
+    int_64               expired;
+    int_64               rejected;
+};
+
+enum dnsfs_connect
+{
+    dc_unknown,
+    dc_reachable,
+    dc_unreachable
+};
+
+/* what a TCP connect to an address on the probe port last did; shared by
+ * all names that resolve to that address */
+struct dnsfs_probe
+{
+    struct dnsfs_probe *next;
+    struct dnsfs_probe *queue_next;
+    char                key[34];
+    int                 family;
+    unsigned char       address[16];
+    int                 fd;
+    enum dnsfs_connect  state;
+    char                queued;
+    int_64              started;
+    int_64              probed;
+    int_64              used;
+    int_64              rtt;
+    int_32              failures;
+};
+
+static struct dnsfs_upstream *upstreams = (struct dnsfs_upstream *)0;
+static struct dnsfs_lookup   *lookups   = (struct dnsfs_lookup *)0;
+static struct tree           *probes;
+static struct dnsfs_probe    *probe_list       = (struct dnsfs_probe *)0;
+static struct dnsfs_probe    *probe_queue      = (struct dnsfs_probe *)0;
+static struct dnsfs_probe    *probe_queue_tail = (struct dnsfs_probe *)0;
+static int_32                 probe_queued  = 0;
+static struct dnsfs_probe    *probe_active[DNSFS_PROBE_PARALLEL];
+static int                    probe_port    = 0;
+static int_32                 probe_tokens  = DNSFS_PROBE_RATE;
+static int_64                 probe_refill  = 0;
+static int_64                 probe_swept   = 0;
+static int_32                 resolver_window = DNSFS_WINDOW;
+static int_32                 resolver_active = 0;
+static struct dnsfs_queue     resolver_queue[2] =
+{
+    { .timeout = DNSFS_QUEUE_TIMEOUT_INTERACTIVE },
+    { .timeout = DNSFS_QUEUE_TIMEOUT_BULK }
+};
+static struct tree           *entries;
+static struct tree           *entry_dirs; /* name and zone dirs to entries */
+static struct dnsfs_label     labels;
+static struct dfs_directory  *zones     = (struct dfs_directory *)0;
+static struct dnsfs_entry    *lru_head  = (struct dnsfs_entry *)0;
+static struct dnsfs_entry    *lru_tail  = (struct dnsfs_entry *)0;
+static struct dnsfs_entry    *order_head = (struct dnsfs_entry *)0;
+static struct dnsfs_entry    *order_tail = (struct dnsfs_entry *)0;
+static struct dnsfs_dump_cursor *dump_cursors = (struct dnsfs_dump_cursor *)0;
+static int_32                 read_fid  = 0; /* fid of the Tread in on_read */
+static struct dfs_directory  *names_root = (struct dfs_directory *)0;
+static struct dnsfs_upstream *retired   = (struct dnsfs_upstream *)0;
+static int_32                 ttl_floor      = 0;
+static int_32                 ttl_ceiling    = DNSFS_TTL_CEILING;
+static int_32                 cache_limit    = DNSFS_CACHE_LIMIT;
+static int_32                 cache_size     = 0;
+static int_64                 imported       = 0;
+static int_64                 import_rejected = 0;
+static char                   o_prefetch     = 1;
+static char                   o_serve_stale  = 0;
+static const char            *status_command = "nop";
+static const char            *status_error   = (const char *)0;
+static int                    resolver_timer = -1;
+static int                    random_fd  = -1;
+static unsigned char          random_pool[256];
+static unsigned int           random_used = sizeof (random_pool);
+
+static int_64 dnsfs_now ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ((int_64)ts.tv_sec * 1000000) + (int_64)(ts.tv_nsec / 1000);
+}
+
+/* request traces live in a fixed ring that only the multiplex loop writes
+ * to; a slot belongs to a request while its sequence number matches */
+struct dnsfs_trace
+{
+    int_32              sequence;
+    enum dnsfs_trace_op op;
+    int_16              tag;
+    int_64              received;
+    int_64              resolve_start;
+    int_64              resolve_end;
+    int_64              replied;
+    char                name[DNSFS_TRACE_NAME];
+};
+
+static struct dnsfs_trace traces[DNSFS_TRACE_SIZE];
+static int_32             trace_sequence  = 0;
+static int_32             trace_sample    = 0; /* one in n requests, 0: off */
+static int_32             trace_countdown = 0;
+static int_32             trace_current   = 0;
+static char               trace_deferred  = 0;
+
+static struct dnsfs_trace *dnsfs_trace_get (int_32 sequence)
+{
+    struct dnsfs_trace *t = &(traces[sequence % DNSFS_TRACE_SIZE]);
+
+    return ((sequence > 0) && (t->sequence == sequence))
+         ? t : (struct dnsfs_trace *)0;
+}
+
+static void dnsfs_trace_begin
+    (enum dnsfs_trace_op op, int_16 tag, const char *name)
+{
+    struct dnsfs_trace *t;
+
+    trace_current  = 0;
+    trace_deferred = 0;
+
+    if ((trace_sample <= 0) || (--trace_countdown > 0))
+    {
+        return;
+    }
+
+    trace_countdown = trace_sample;
+
+    if (trace_sequence == 0x7fffffff)
+    {
+        trace_sequence = 0;
+    }
+
+    trace_current = ++trace_sequence;
+
+    t = &(traces[trace_current % DNSFS_TRACE_SIZE]);
+
+    t->sequence      = trace_current;
+    t->op            = op;
+    t->tag           = tag;
+    t->received      = dnsfs_now ();
+    t->resolve_start = 0;
+    t->resolve_end   = 0;
+    t->replied       = 0;
+
+    strncpy (t->name, name, DNSFS_TRACE_NAME - 1);
+    t->name[DNSFS_TRACE_NAME - 1] = 0;
+}
+
+/* a request that was handed to a lookup is finished by that lookup */
+static void dnsfs_trace_end ()
+{
+    struct dnsfs_trace *t = dnsfs_trace_get (trace_current);
+
+    if ((t != (struct dnsfs_trace *)0) && !trace_deferred)
+    {
+        t->replied = dnsfs_now ();
+    }
+
+    trace_current  = 0;
+    trace_deferred = 0;
+}
+
+static int_32 dnsfs_trace_defer (char active, int_64 now)
+{
+    struct dnsfs_trace *t = dnsfs_trace_get (trace_current);
+
+    if (t == (struct dnsfs_trace *)0)
+    {
+        return 0;
+    }
+
+    trace_deferred = 1;
+
+    if (active)
     {
-        struct addrinfo *c         = ai;
-	struct io       *io_ip4    = io_open_special ();
-	struct sexpr_io *io_ip4_sx = sx_open_o       (io_ip4);
-	char            *ip4_b;
-	struct io       *io_ip6    = io_open_special ();
-	struct sexpr_io *io_ip6_sx = sx_open_o       (io_ip6);
-	char            *ip6_b;
+        t->resolve_start = now;
+    }
+
+    return trace_current;
+}
+
+/* query IDs have to be unpredictable to off-path attackers, so they come
+ * straight from the kernel's random pool rather than a local generator */
+static int_32 dnsfs_random_id ()
+{
+    int_32 id;
+
+    if (random_used > (sizeof (random_pool) - 2))
+    {
+        int r;
 
-	while (c->ai_next != (struct addrinfo *)0)
+        if (random_fd < 0)
         {
-	    struct sockaddr_in  *ip4;
-	    struct sockaddr_in6 *ip6;
-	    unsigned long l;
-	    sexpr type = sx_nil;
+            random_fd = open ("/dev/urandom", O_RDONLY);
+        }
 
-            switch (c->ai_socktype)
-            {
-                case SOCK_STREAM: type = sym_stream; break;
-                case SOCK_DGRAM:  type = sym_dgram;  break;
-                case 0:           type = sym_any;    break;
-            }
+        r = (random_fd < 0) ? -1 :
+            read (random_fd, random_pool, sizeof (random_pool));
 
-	    switch (c->ai_family)
-	    {
-                case AF_INET:
-                    ip4 = (struct sockaddr_in *)c->ai_addr;
-                    l = ip4->sin_addr.s_addr;
-
-		    sx_write (io_ip4_sx,
-		              cons (sym_ip4,
-                                 cons (type,
-		                 cons (make_integer (((l)       & 0xff)),
-		                 cons (make_integer (((l >> 8)  & 0xff)),
-		                 cons (make_integer (((l >> 16) & 0xff)),
-		                 cons (make_integer (((l >> 24) & 0xff)),
-                                       sx_end_of_list)))))));
-		    break;
-                case AF_INET6:
-                    ip6 = (struct sockaddr_in6 *)c->ai_addr;
+        if (r != (int)sizeof (random_pool))
+        {
+            return -1;
+        }
+
+        random_used = 0;
+    }
 
-		    sx_write (io_ip6_sx,
-		              cons (sym_ip6,
-                                 cons (type,
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[0])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[1])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[2])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[3])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[4])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[5])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[6])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[7])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[8])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[9])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[10])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[11])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[12])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[13])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[14])),
-		                 cons (make_integer ((ip6->sin6_addr.s6_addr[15])),
-                                       sx_end_of_list)))))))))))))))))));
-		    break;
-	    }
-
-	    c = c->ai_next;
-	}
-
-	ip4_b = resize_mem (io_ip4->length, io_ip4->buffer, io_ip4->buffersize);
-	io_ip4->buffer = (char*)0;
-	io_ip4->buffersize = 0;
-	ip6_b = resize_mem (io_ip6->length, io_ip6->buffer, io_ip6->buffersize);
-	io_ip6->buffer = (char*)0;
-	io_ip6->buffersize = 0;
-
-        add_file_with_content ("ip4", ip4_b, io_ip4->length, d_dir);
-        add_file_with_content ("ip6", ip6_b, io_ip6->length, d_dir);
-
-	sx_close_io (io_ip4_sx);
-	sx_close_io (io_ip6_sx);
+    id = ((int_32)random_pool[random_used] << 8) |
+          (int_32)random_pool[random_used + 1];
 
-        freeaddrinfo (ai);
+    random_used += 2;
+
+    return id;
+}
+
+static char *dnsfs_strdup (const char *s)
+{
+    unsigned long l = strlen (s) + 1;
+    char *r = aalloc (l);
+
+    memcpy (r, s, l);
+
+    return r;
+}
+
+/* nodes for cached names are allocated here rather than by dfs, so that
+ * they can be freed once the name is dropped; until then fids hold them */
+static struct tree *holds;
+static struct tree *dead;
+
+static struct dfs_directory *dnsfs_mk_directory
+    (struct dfs_directory *parent, char *name)
+{
+    struct dfs_directory *d = aalloc (sizeof (struct dfs_directory));
+
+    memset (d, 0, sizeof (struct dfs_directory));
+
+    d->c.type  = dft_directory;
+    d->c.name  = dnsfs_strdup (name);
+    d->nodes   = tree_create ();
+    d->parent  = parent;
+
+    tree_add_node_string_value (parent->nodes, d->c.name, (void *)d);
+
+    return d;
+}
+
+static struct dfs_file *dnsfs_mk_file
+    (struct dfs_directory *dir, char *name, int_8 *data, int_64 length,
+     void *aux,
+     void (*on_read)(struct d9r_io *, int_16, struct dfs_file *, int_64,
+                     int_32))
+{
+    struct dfs_file *f = aalloc (sizeof (struct dfs_file));
+
+    memset (f, 0, sizeof (struct dfs_file));
+
+    f->c.type   = dft_file;
+    f->c.name   = dnsfs_strdup (name);
+    f->c.length = length;
+    f->data     = data;
+    f->aux      = aux;
+    f->on_read  = on_read;
+
+    tree_add_node_string_value (dir->nodes, f->c.name, (void *)f);
+
+    return f;
+}
+
+static void dnsfs_free_node (struct dfs_node_common *c)
+{
+    afree (strlen (c->name) + 1, c->name);
+
+    if (c->type == dft_directory)
+    {
+        tree_destroy (((struct dfs_directory *)c)->nodes);
+        afree (sizeof (struct dfs_directory), c);
+    }
+    else
+    {
+        afree (sizeof (struct dfs_file), c);
     }
 }
 
-static void Tcreate (struct d9r_io *io, int_16 tag, int_32 fid, char *name, int_32 perm, int_8 mode, char *ext)
+static int_pointer dnsfs_hold_count (void *c)
 {
-    struct d9r_fid_metadata *md = d9r_fid_metadata (io, fid);
-    struct dfs_node_common *c = md->aux;
-    struct dfs_directory *d;
-    struct d9r_qid qid = { 0, 1, 2 };
+    struct tree_node *node = tree_get_node (holds, (int_pointer)c);
 
-    if (c->type != dft_directory)
+    return (node == (struct tree_node *)0) ? 0
+         : (int_pointer)node_get_value (node);
+}
+
+static void dnsfs_hold (void *c)
+{
+    int_pointer n = dnsfs_hold_count (c);
+
+    if (n > 0)
     {
-        d9r_reply_error (io, tag,
-                         "Cannot create nodes under anything but a directory.",
-                         P9_EDONTCARE);
+        tree_remove_node (holds, (int_pointer)c);
+    }
+
+    tree_add_node_value (holds, (int_pointer)c, (void *)(n + 1));
+}
+
+static void dnsfs_unhold (void *c)
+{
+    int_pointer n = dnsfs_hold_count (c);
+
+    if (n == 0)
+    {
+        return;
+    }
+
+    tree_remove_node (holds, (int_pointer)c);
+
+    if (n > 1)
+    {
+        tree_add_node_value (holds, (int_pointer)c, (void *)(n - 1));
+    }
+    else if (tree_get_node (dead, (int_pointer)c) != (struct tree_node *)0)
+    {
+        tree_remove_node (dead, (int_pointer)c);
+        dnsfs_free_node ((struct dfs_node_common *)c);
+    }
+}
+
+/* the node must already be unlinked; a directory that is still held is
+ * moved under the root so that its .. stays valid */
+static void dnsfs_release_node (struct dfs_node_common *c)
+{
+    if (dnsfs_hold_count (c) == 0)
+    {
+        dnsfs_free_node (c);
+        return;
+    }
+
+    if (c->type == dft_directory)
+    {
+        ((struct dfs_directory *)c)->parent = names_root;
+    }
+
+    tree_add_node_value (dead, (int_pointer)c, (void *)c);
+}
+
+static sexpr dnsfs_pair (sexpr key, int_64 value)
+{
+    return cons (key, cons (make_integer (value), sx_end_of_list));
+}
+
+static void dnsfs_reply_buffer
+    (struct d9r_io *io, int_16 tag, int_64 offset, int_32 length,
+     struct io *b)
+{
+    if (offset >= (int_64)b->length)
+    {
+        d9r_reply_read (io, tag, 0, (int_8 *)0);
         return;
     }
 
-    d = (struct dfs_directory *)c;
+    if ((int_64)length > ((int_64)b->length - offset))
+    {
+        length = (int_32)(b->length - offset);
+    }
+
+    d9r_reply_read (io, tag, length, (int_8 *)(b->buffer + offset));
+}
+
+static int dnsfs_encode_query
+    (unsigned char *b, int_32 id, const char *name, int_16 qtype)
+{
+    int p = 12, l;
+
+    b[0]  = (unsigned char)(id >> 8);
+    b[1]  = (unsigned char)(id & 0xff);
+    b[2]  = 0x01; /* RD */
+    b[3]  = 0;
+    b[4]  = 0;
+    b[5]  = 1;
+    b[6]  = 0;
+    b[7]  = 0;
+    b[8]  = 0;
+    b[9]  = 0;
+    b[10] = 0;
+    b[11] = 0;
+
+    if (name[0] == 0)
+    {
+        return -1;
+    }
+
+    while (name[0] != 0)
+    {
+        for (l = 0; (name[l] != 0) && (name[l] != '.'); l++);
+
+        if ((l == 0) || (l > 63) || ((p + l + 1) > (12 + 254)))
+        {
+            return -1;
+        }
+
+        b[p] = (unsigned char)l;
+        p++;
+        memcpy (b + p, name, l);
+        p += l;
+        name += l;
+
+        if (name[0] == '.')
+        {
+            name++;
+        }
+    }
+
+    b[p]   = 0;
+    b[p+1] = (unsigned char)(qtype >> 8);
+    b[p+2] = (unsigned char)(qtype & 0xff);
+    b[p+3] = 0;
+    b[p+4] = 1;
+    p     += 5;
+
+    /* EDNS0 OPT record advertising our buffer size, so that answers with
+     * many addresses aren't truncated to 512 bytes */
+    b[11]  = 1;
+    b[p]   = 0;
+    b[p+1] = 0;
+    b[p+2] = 41;
+    b[p+3] = (unsigned char)(DNSFS_PACKET_SIZE >> 8);
+    b[p+4] = (unsigned char)(DNSFS_PACKET_SIZE & 0xff);
+    memset (b + p + 5, 0, 6);
+
+    return p + 11;
+}
+
+static char dnsfs_valid_name (const char *name)
+{
+    unsigned char b[DNSFS_PACKET_SIZE];
+
+    return dnsfs_encode_query (b, 0, name, DNS_TYPE_A) > 0;
+}
+
+/* names are kept lower case and without the trailing dot, so that every
+ * spelling of a name maps to the same entry and the same label */
+static char dnsfs_canonical_name (char *out, const char *name)
+{
+    int i;
+
+    for (i = 0; name[i] != 0; i++)
+    {
+        if (i >= (DNSFS_NAME_SIZE - 1))
+        {
+            return 0;
+        }
+
+        out[i] = ((name[i] >= 'A') && (name[i] <= 'Z'))
+               ? (char)(name[i] - 'A' + 'a') : name[i];
+    }
+
+    if ((i > 0) && (out[i-1] == '.'))
+    {
+        i--;
+    }
+
+    out[i] = 0;
+
+    for (i = 0; out[i] != 0; i++)
+    {
+        /* not a host name anyway, and taken by the zone view */
+        if ((out[i] == '@') && ((i == 0) || (out[i-1] == '.')) &&
+            ((out[i+1] == 0) || (out[i+1] == '.')))
+        {
+            return 0;
+        }
+    }
+
+    return dnsfs_valid_name (out);
+}
+
+/* other spellings of a cached name find its directory too */
+static struct tree_node *dnsfs_walk_lookup (struct dfs_directory *d, char *name)
+{
+    struct tree_node *node = tree_get_node_string (d->nodes, name);
+    char canonical[DNSFS_NAME_SIZE];
+
+    if ((node == (struct tree_node *)0) && (d == names_root) &&
+        dnsfs_canonical_name (canonical, name))
+    {
+        node = tree_get_node_string (d->nodes, canonical);
+    }
+
+    return node;
+}
+
+static int dnsfs_skip_name (const unsigned char *b, int len, int p)
+{
+    while (p < len)
+    {
+        if (b[p] == 0)
+        {
+            return p + 1;
+        }
+        else if ((b[p] & 0xc0) == 0xc0)
+        {
+            return ((p + 2) <= len) ? (p + 2) : -1;
+        }
+        else if ((b[p] & 0xc0) != 0)
+        {
+            return -1;
+        }
+
+        p += b[p] + 1;
+    }
+
+    return -1;
+}
+
+static char dnsfs_question_matches
+    (const unsigned char *b, int len, const char *name, int_16 qtype)
+{
+    int p = 12, i;
+
+    while ((p < len) && (b[p] != 0))
+    {
+        int l = b[p];
+
+        if (((l & 0xc0) != 0) || ((p + l + 1) > len))
+        {
+            return 0;
+        }
+
+        p++;
+
+        for (i = 0; i < l; i++, p++, name++)
+        {
+            char c = (char)b[p], n = *name;
+
+            if ((c >= 'A') && (c <= 'Z')) c += 'a' - 'A';
+            if ((n >= 'A') && (n <= 'Z')) n += 'a' - 'A';
+
+            if (c != n)
+            {
+                return 0;
+            }
+        }
+
+        if (name[0] == '.')
+        {
+            name++;
+        }
+        else if (name[0] != 0)
+        {
+            return 0;
+        }
+    }
+
+    if ((p + 5) > len)
+    {
+        return 0;
+    }
+
+    return (name[0] == 0) &&
+           (b[p+1] == (unsigned char)(qtype >> 8)) &&
+           (b[p+2] == (unsigned char)(qtype & 0xff));
+}
+
+static struct dnsfs_upstream *dnsfs_upstream_open (const char *spec)
+{
+    char host[256];
+    const char *port = "53";
+    const char *colon = (const char *)0;
+    struct addrinfo hints, *ai;
+    struct dnsfs_upstream *u;
+    int i, colons = 0;
+
+    for (i = 0; spec[i] != 0; i++)
+    {
+        if (spec[i] == ':')
+        {
+            colons++;
+            colon = spec + i;
+        }
+    }
+
+    if (spec[0] == '[')
+    {
+        for (i = 1; (spec[i] != 0) && (spec[i] != ']') && (i < 256); i++)
+        {
+            host[i-1] = spec[i];
+        }
+
+        if (spec[i] != ']')
+        {
+            return (struct dnsfs_upstream *)0;
+        }
+
+        host[i-1] = 0;
+
+        if (spec[i+1] == ':')
+        {
+            port = spec + i + 2;
+        }
+    }
+    else if (colons == 1)
+    {
+        if ((colon - spec) >= 256)
+        {
+            return (struct dnsfs_upstream *)0;
+        }
+
+        memcpy (host, spec, colon - spec);
+        host[colon - spec] = 0;
+        port = colon + 1;
+    }
+    else
+    {
+        if (strlen (spec) >= 256)
+        {
+            return (struct dnsfs_upstream *)0;
+        }
+
+        strcpy (host, spec);
+    }
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo (host, port, &hints, &ai) != 0)
+    {
+        return (struct dnsfs_upstream *)0;
+    }
+
+    if (ai->ai_addrlen > sizeof (struct sockaddr_storage))
+    {
+        freeaddrinfo (ai);
+        return (struct dnsfs_upstream *)0;
+    }
+
+    u = aalloc (sizeof (struct dnsfs_upstream));
+    memset (u, 0, sizeof (struct dnsfs_upstream));
+
+    u->name           = dnsfs_strdup (spec);
+    u->address_length = ai->ai_addrlen;
+    memcpy (&(u->address), ai->ai_addr, ai->ai_addrlen);
+
+    freeaddrinfo (ai);
+
+    return u;
+}
+
+static void dnsfs_upstream_close (struct dnsfs_upstream *u)
+{
+    afree (strlen (u->name) + 1, u->name);
+    afree (sizeof (struct dnsfs_upstream), u);
+}
+
+static void dnsfs_add_upstream (const char *spec)
+{
+    struct dnsfs_upstream *u = dnsfs_upstream_open (spec), **p;
+
+    if (u == (struct dnsfs_upstream *)0)
+    {
+        return;
+    }
+
+    for (p = &upstreams; *p != (struct dnsfs_upstream *)0; p = &((*p)->next));
+
+    *p = u;
+}
+
+static char dnsfs_upstream_healthy (struct dnsfs_upstream *u, int_64 now)
+{
+    return (u->failrate < DNSFS_UNHEALTHY) ||
+           ((now - u->last_failure) > DNSFS_HEALTH_RETRY);
+}
+
+static int_64 dnsfs_upstream_score (struct dnsfs_upstream *u)
+{
+    if (u->samples == 0)
+    {
+        return 0;
+    }
+
+    return ((u->srtt + 4 * u->rttvar) * (1000 + 9 * u->failrate)) / 1000;
+}
+
+static int_64 dnsfs_hedge_delay (struct dnsfs_upstream *u)
+{
+    int_64 d;
+
+    if (u->samples == 0)
+    {
+        return DNSFS_HEDGE_INITIAL;
+    }
+
+    d = u->srtt + 4 * u->rttvar;
+
+    if (d < DNSFS_HEDGE_MIN) d = DNSFS_HEDGE_MIN;
+    if (d > DNSFS_HEDGE_MAX) d = DNSFS_HEDGE_MAX;
+
+    return d;
+}
+
+static void dnsfs_upstream_sample (struct dnsfs_upstream *u, int_64 rtt)
+{
+    if (u->samples == 0)
+    {
+        u->srtt   = rtt;
+        u->rttvar = rtt / 2;
+    }
+    else
+    {
+        int_64 delta = rtt - u->srtt;
+
+        if (delta < 0) delta = -delta;
+
+        u->rttvar += (delta - u->rttvar) / 4;
+        u->srtt   += (rtt - u->srtt) / 8;
+    }
+
+    u->samples++;
+    u->answers++;
+    u->failrate -= u->failrate / 8;
+}
+
+static void dnsfs_upstream_failure (struct dnsfs_upstream *u, int_64 now)
+{
+    u->failures++;
+    u->failrate    += (1000 - u->failrate) / 4;
+    u->last_failure = now;
+}
+
+static char dnsfs_lookup_used
+    (struct dnsfs_lookup *l, struct dnsfs_upstream *u)
+{
+    int a;
+
+    for (a = 0; a < l->attempts; a++)
+    {
+        if (l->attempt[a].upstream == u)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static struct dnsfs_upstream *dnsfs_select_upstream
+    (struct dnsfs_lookup *l, int_64 now)
+{
+    struct dnsfs_upstream *u, *best = (struct dnsfs_upstream *)0;
+    char b_used = 0, b_healthy = 0;
+    int_64 b_score = 0;
+
+    for (u = upstreams; u != (struct dnsfs_upstream *)0; u = u->next)
+    {
+        char used    = dnsfs_lookup_used (l, u);
+        char healthy = dnsfs_upstream_healthy (u, now);
+        int_64 score = dnsfs_upstream_score (u);
+
+        if ((best == (struct dnsfs_upstream *)0) ||
+            (used < b_used) ||
+            ((used == b_used) && (healthy > b_healthy)) ||
+            ((used == b_used) && (healthy == b_healthy) && (score < b_score)))
+        {
+            best      = u;
+            b_used    = used;
+            b_healthy = healthy;
+            b_score   = score;
+        }
+    }
+
+    return best;
+}
+
+static int dnsfs_attempt_socket (struct dnsfs_upstream *u)
+{
+    int fd = socket (u->address.ss_family, SOCK_DGRAM, 0);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if ((fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) < 0) ||
+        (fcntl (fd, F_SETFD, FD_CLOEXEC) < 0) ||
+        (connect (fd, (struct sockaddr *)&(u->address), u->address_length)
+             < 0))
+    {
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void dnsfs_lookup_transmit (struct dnsfs_lookup *l, int_64 now)
+{
+    struct dnsfs_upstream *u = dnsfs_select_upstream (l, now);
+    unsigned char packet[DNSFS_PACKET_SIZE];
+    char failed = 0;
+    int q, len, fd;
+
+    if ((u == (struct dnsfs_upstream *)0) || (l->attempts >= DNSFS_MAX_ATTEMPTS))
+    {
+        l->next_attempt = l->deadline;
+        return;
+    }
+
+    fd = dnsfs_attempt_socket (u);
+
+    for (q = 0; q < 2; q++)
+    {
+        if (l->done[q])
+        {
+            continue;
+        }
+
+        len = dnsfs_encode_query (packet, l->id[q], l->entry->name,
+                                  (q == 0) ? DNS_TYPE_A : DNS_TYPE_AAAA);
+
+        if ((fd < 0) || ((len > 0) && (send (fd, packet, len, 0) < 0)))
+        {
+            failed = 1;
+        }
+    }
+
+    u->queries++;
+
+    if (l->attempts > 0)
+    {
+        u->hedges++;
+    }
+
+    l->attempt[l->attempts].upstream = u;
+    l->attempt[l->attempts].fd       = fd;
+    l->attempt[l->attempts].sent     = now;
+    l->attempt[l->attempts].answered = 0;
+    l->attempts++;
+
+    if (l->attempts >= DNSFS_MAX_ATTEMPTS)
+    {
+        l->next_attempt = l->deadline;
+    }
+    else if (failed)
+    {
+        dnsfs_upstream_failure (u, now);
+        l->next_attempt = now;
+    }
+    else
+    {
+        l->next_attempt = now + dnsfs_hedge_delay (u);
+    }
+}
+
+static sexpr dnsfs_bytes_sx (const unsigned char *a, int len)
+{
+    sexpr r = sx_end_of_list;
+
+    while (len > 0)
+    {
+        len--;
+        r = cons (make_integer (a[len]), r);
+    }
+
+    return r;
+}
+
+static sexpr dnsfs_address_sx
+    (sexpr family, sexpr type, const unsigned char *a, int len)
+{
+    return cons (family, cons (type, dnsfs_bytes_sx (a, len)));
+}
+
+static struct dnsfs_probe *dnsfs_probe_get
+    (int family, const unsigned char *a, int len)
+{
+    static const char *hex = "0123456789abcdef";
+    struct dnsfs_probe *p;
+    struct tree_node *node;
+    char key[34];
+    int i;
+
+    key[0] = (family == AF_INET6) ? '6' : '4';
+
+    for (i = 0; i < len; i++)
+    {
+        key[(i * 2) + 1] = hex[a[i] >> 4];
+        key[(i * 2) + 2] = hex[a[i] & 0xf];
+    }
+
+    key[(len * 2) + 1] = 0;
+
+    if ((node = tree_get_node_string (probes, key)) != (struct tree_node *)0)
+    {
+        return (struct dnsfs_probe *)node_get_value (node);
+    }
+
+    p = aalloc (sizeof (struct dnsfs_probe));
+    memset (p, 0, sizeof (struct dnsfs_probe));
+
+    memcpy (p->key, key, (len * 2) + 2);
+    memcpy (p->address, a, len);
+
+    p->family  = family;
+    p->fd      = -1;
+    p->state   = dc_unknown;
+    p->next    = probe_list;
+    probe_list = p;
+
+    tree_add_node_string_value (probes, p->key, (void *)p);
+
+    return p;
+}
+
+/* asks for a probe if the last result is too old; they are started from
+ * the resolver tick, at most DNSFS_PROBE_RATE a second, and only ever
+ * for best files that are read, so the queue stays short */
+static void dnsfs_probe_want (struct dnsfs_probe *p, int_64 now)
+{
+    p->used = now;
+
+    if ((p->fd != -1) || p->queued || (probe_queued >= DNSFS_PROBE_QUEUE) ||
+        ((p->probed != 0) && ((now - p->probed) < DNSFS_PROBE_INTERVAL)))
+    {
+        return;
+    }
+
+    probe_queued++;
+
+    p->queued     = 1;
+    p->queue_next = (struct dnsfs_probe *)0;
+
+    if (probe_queue_tail == (struct dnsfs_probe *)0)
+    {
+        probe_queue = p;
+    }
+    else
+    {
+        probe_queue_tail->queue_next = p;
+    }
+
+    probe_queue_tail = p;
+}
+
+static void dnsfs_probe_finish (struct dnsfs_probe *p, char ok, int_64 now)
+{
+    int i;
+
+    for (i = 0; i < DNSFS_PROBE_PARALLEL; i++)
+    {
+        if (probe_active[i] == p)
+        {
+            probe_active[i] = (struct dnsfs_probe *)0;
+        }
+    }
+
+    if (p->fd != -1)
+    {
+        close (p->fd);
+        p->fd = -1;
+    }
+
+    if (ok)
+    {
+        int_64 sample = now - p->started;
+
+        p->rtt      = (p->state == dc_reachable)
+                    ? p->rtt + ((sample - p->rtt) / 4) : sample;
+        p->state    = dc_reachable;
+        p->failures = 0;
+    }
+    else
+    {
+        p->state = dc_unreachable;
+        p->failures++;
+    }
+
+    p->probed = now;
+}
+
+static void dnsfs_probe_start (struct dnsfs_probe *p, int slot, int_64 now)
+{
+    struct sockaddr_in  ip4;
+    struct sockaddr_in6 ip6;
+    struct sockaddr *sa;
+    socklen_t salen;
+    int fd;
+
+    p->started = now;
+
+    if (p->family == AF_INET6)
+    {
+        memset (&ip6, 0, sizeof (ip6));
+        ip6.sin6_family = AF_INET6;
+        ip6.sin6_port   = htons ((unsigned short)probe_port);
+        memcpy (&(ip6.sin6_addr), p->address, 16);
+
+        sa    = (struct sockaddr *)&ip6;
+        salen = sizeof (ip6);
+    }
+    else
+    {
+        memset (&ip4, 0, sizeof (ip4));
+        ip4.sin_family = AF_INET;
+        ip4.sin_port   = htons ((unsigned short)probe_port);
+        memcpy (&(ip4.sin_addr), p->address, 4);
+
+        sa    = (struct sockaddr *)&ip4;
+        salen = sizeof (ip4);
+    }
+
+    if ((fd = socket (p->family, SOCK_STREAM, 0)) < 0)
+    {
+        dnsfs_probe_finish (p, 0, now);
+        return;
+    }
+
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+    p->fd = fd;
+
+    if (connect (fd, sa, salen) == 0)
+    {
+        dnsfs_probe_finish (p, 1, now);
+    }
+    else if (errno != EINPROGRESS)
+    {
+        dnsfs_probe_finish (p, 0, now);
+    }
+    else
+    {
+        probe_active[slot] = p;
+    }
+}
+
+static void dnsfs_probe_connected (struct dnsfs_probe *p, int_64 now)
+{
+    int error = 0;
+    socklen_t len = sizeof (error);
+
+    if (getsockopt (p->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+    {
+        error = errno;
+    }
+
+    dnsfs_probe_finish (p, error == 0, now);
+}
+
+static void dnsfs_probe_sweep (int_64 now)
+{
+    struct dnsfs_probe **l = &probe_list, *p;
+
+    while ((p = *l) != (struct dnsfs_probe *)0)
+    {
+        if ((p->fd == -1) && !p->queued &&
+            ((now - p->used) > DNSFS_PROBE_KEEP))
+        {
+            *l = p->next;
+            tree_remove_node_string (probes, p->key);
+            afree (sizeof (struct dnsfs_probe), p);
+        }
+        else
+        {
+            l = &(p->next);
+        }
+    }
+
+    probe_swept = now;
+}
+
+static void dnsfs_probe_tick (int_64 now)
+{
+    int i;
+
+    for (i = 0; i < DNSFS_PROBE_PARALLEL; i++)
+    {
+        if ((probe_active[i] != (struct dnsfs_probe *)0) &&
+            ((now - probe_active[i]->started) >= DNSFS_PROBE_TIMEOUT))
+        {
+            dnsfs_probe_finish (probe_active[i], 0, now);
+        }
+    }
+
+    if (probe_tokens < DNSFS_PROBE_RATE)
+    {
+        int_64 refill = ((now - probe_refill) * DNSFS_PROBE_RATE) / 1000000;
+
+        if (refill > 0)
+        {
+            probe_tokens += (refill > DNSFS_PROBE_RATE)
+                          ? DNSFS_PROBE_RATE : (int_32)refill;
+            probe_refill  = now;
+
+            if (probe_tokens > DNSFS_PROBE_RATE)
+            {
+                probe_tokens = DNSFS_PROBE_RATE;
+            }
+        }
+    }
+    else
+    {
+        probe_refill = now;
+    }
+
+    for (i = 0; (i < DNSFS_PROBE_PARALLEL) && (probe_tokens > 0) &&
+                (probe_queue != (struct dnsfs_probe *)0); i++)
+    {
+        if (probe_active[i] == (struct dnsfs_probe *)0)
+        {
+            struct dnsfs_probe *p = probe_queue;
+
+            if ((probe_queue = p->queue_next) == (struct dnsfs_probe *)0)
+            {
+                probe_queue_tail = (struct dnsfs_probe *)0;
+            }
+
+            p->queued = 0;
+            probe_queued--;
+            probe_tokens--;
+
+            dnsfs_probe_start (p, i, now);
+        }
+    }
+
+    if ((now - probe_swept) > (DNSFS_PROBE_KEEP / 10))
+    {
+        dnsfs_probe_sweep (now);
+    }
+}
+
+static char dnsfs_probe_busy ()
+{
+    int i;
+
+    for (i = 0; i < DNSFS_PROBE_PARALLEL; i++)
+    {
+        if (probe_active[i] != (struct dnsfs_probe *)0)
+        {
+            return 1;
+        }
+    }
+
+    return probe_queue != (struct dnsfs_probe *)0;
+}
+
+static int_64 dnsfs_probe_deadline (int_64 next)
+{
+    int i;
+
+    for (i = 0; i < DNSFS_PROBE_PARALLEL; i++)
+    {
+        if ((probe_active[i] != (struct dnsfs_probe *)0) &&
+            ((probe_active[i]->started + DNSFS_PROBE_TIMEOUT) < next))
+        {
+            next = probe_active[i]->started + DNSFS_PROBE_TIMEOUT;
+        }
+    }
+
+    if ((probe_queue != (struct dnsfs_probe *)0) &&
+        ((probe_refill + (1000000 / DNSFS_PROBE_RATE)) < next))
+    {
+        next = probe_refill + (1000000 / DNSFS_PROBE_RATE);
+    }
+
+    return next;
+}
+
+static void dnsfs_entry_probe (struct dnsfs_entry *e, int_64 now)
+{
+    unsigned int i;
+
+    for (i = 0; i < e->n6; i++)
+    {
+        dnsfs_probe_want
+            (dnsfs_probe_get (AF_INET6, e->a6 + (i * 16), 16), now);
+    }
+
+    for (i = 0; i < e->n4; i++)
+    {
+        dnsfs_probe_want
+            (dnsfs_probe_get (AF_INET, e->a4 + (i * 4), 4), now);
+    }
+}
+
+static int dnsfs_probe_rank (struct dnsfs_probe *p)
+{
+    return (p->state == dc_reachable) ? 0 :
+           (p->state == dc_unknown)   ? 1 : 2;
+}
+
+static char dnsfs_probe_before (struct dnsfs_probe *a, struct dnsfs_probe *b)
+{
+    if (dnsfs_probe_rank (a) != dnsfs_probe_rank (b))
+    {
+        return dnsfs_probe_rank (a) < dnsfs_probe_rank (b);
+    }
+
+    switch (a->state)
+    {
+        case dc_reachable:   return a->rtt < b->rtt;
+        case dc_unreachable: return a->failures < b->failures;
+        case dc_unknown:     break;
+    }
+
+    return 0;
+}
+
+/* reachable addresses by connect time, then the untested ones alternating
+ * between families starting with ip6 as in RFC 8305, then the rest */
+static void on_best_read
+    (struct d9r_io *io, int_16 tag, struct dfs_file *f, int_64 offset,
+     int_32 length)
+{
+    struct dnsfs_entry *e = (struct dnsfs_entry *)f->aux;
+    struct dnsfs_probe *order[DNSFS_MAX_ADDRESSES * 2], *p;
+    struct io       *b    = io_open_special ();
+    struct sexpr_io *b_sx = sx_open_o (b);
+    int_64 now = dnsfs_now ();
+    unsigned int n = 0, i, j;
+
+    if (e != (struct dnsfs_entry *)0)
+    {
+        unsigned int i6 = 0, i4 = 0;
+
+        dnsfs_entry_probe (e, now);
+
+        while ((i6 < e->n6) || (i4 < e->n4))
+        {
+            if (i6 < e->n6)
+            {
+                p = dnsfs_probe_get (AF_INET6, e->a6 + (i6 * 16), 16);
+                i6++;
+
+                for (j = n; (j > 0) && dnsfs_probe_before (p, order[j-1]); j--)
+                {
+                    order[j] = order[j-1];
+                }
+
+                order[j] = p;
+                n++;
+            }
+
+            if (i4 < e->n4)
+            {
+                p = dnsfs_probe_get (AF_INET, e->a4 + (i4 * 4), 4);
+                i4++;
+
+                for (j = n; (j > 0) && dnsfs_probe_before (p, order[j-1]); j--)
+                {
+                    order[j] = order[j-1];
+                }
+
+                order[j] = p;
+                n++;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        p = order[i];
+
+        if (p->family == AF_INET6)
+        {
+            sx_write (b_sx,
+                      dnsfs_address_sx (sym_ip6, sym_stream, p->address, 16));
+        }
+        else
+        {
+            sx_write (b_sx,
+                      dnsfs_address_sx (sym_ip4, sym_stream, p->address, 4));
+        }
+    }
+
+    dnsfs_reply_buffer (io, tag, offset, length, b);
+
+    sx_close_io (b_sx);
+}
+
+static void dnsfs_set_file
+    (struct dnsfs_entry *e, struct dfs_file **f, char *name, struct io *b)
+{
+    char *data = (char *)0;
+
+    if (b->length > 0)
+    {
+        data = aalloc (b->length);
+        memcpy (data, b->buffer, b->length);
+    }
+
+    if (*f == (struct dfs_file *)0)
+    {
+        *f = add_file_with_content (name, data, b->length, e->dir);
+    }
+    else
+    {
+        if ((*f)->data != (int_8 *)0)
+        {
+            afree ((*f)->c.length, (*f)->data);
+        }
+
+        (*f)->data     = (int_8 *)data;
+        (*f)->c.length = b->length;
+    }
+}
+
+static void dnsfs_entry_render (struct dnsfs_entry *e)
+{
+    struct io       *io_ip4    = io_open_special ();
+    struct sexpr_io *io_ip4_sx = sx_open_o       (io_ip4);
+    struct io       *io_ip6    = io_open_special ();
+    struct sexpr_io *io_ip6_sx = sx_open_o       (io_ip6);
+    unsigned int i;
+
+    for (i = 0; i < e->n4; i++)
+    {
+        sx_write (io_ip4_sx,
+                  dnsfs_address_sx (sym_ip4, sym_stream, e->a4 + (i * 4), 4));
+        sx_write (io_ip4_sx,
+                  dnsfs_address_sx (sym_ip4, sym_dgram,  e->a4 + (i * 4), 4));
+    }
+
+    for (i = 0; i < e->n6; i++)
+    {
+        sx_write (io_ip6_sx,
+                  dnsfs_address_sx (sym_ip6, sym_stream, e->a6 + (i * 16), 16));
+        sx_write (io_ip6_sx,
+                  dnsfs_address_sx (sym_ip6, sym_dgram,  e->a6 + (i * 16), 16));
+    }
+
+    dnsfs_set_file (e, &(e->ip4), "ip4", io_ip4);
+    dnsfs_set_file (e, &(e->ip6), "ip6", io_ip6);
+
+    sx_close_io (io_ip4_sx);
+    sx_close_io (io_ip6_sx);
+
+    if (probe_port > 0)
+    {
+        if (e->best == (struct dfs_file *)0)
+        {
+            e->best = dnsfs_mk_file (e->dir, "best", (int_8 *)0, 0, (void *)e,
+                                     on_best_read);
+
+            e->best->c.mode = 0440;
+            e->best->c.uid  = "dnsfs";
+            e->best->c.gid  = "dnsfs";
+        }
+    }
+}
+
+static void dnsfs_entry_set_addresses
+    (struct dnsfs_entry *e, unsigned int n4, const unsigned char *a4,
+     unsigned int n6, const unsigned char *a6, int_32 ttl, int_64 now)
+{
+    if (e->a4 != (unsigned char *)0)
+    {
+        afree (e->n4 * 4, e->a4);
+        e->a4 = (unsigned char *)0;
+    }
+
+    if (e->a6 != (unsigned char *)0)
+    {
+        afree (e->n6 * 16, e->a6);
+        e->a6 = (unsigned char *)0;
+    }
+
+    e->n4 = n4;
+    e->n6 = n6;
+
+    if (n4 > 0)
+    {
+        e->a4 = aalloc (n4 * 4);
+        memcpy (e->a4, a4, n4 * 4);
+    }
+
+    if (n6 > 0)
+    {
+        e->a6 = aalloc (n6 * 16);
+        memcpy (e->a6, a6, n6 * 16);
+    }
+
+    if (ttl < ttl_floor)   ttl = ttl_floor;
+    if (ttl > ttl_ceiling) ttl = ttl_ceiling;
+
+    e->ttl      = ttl;
+    e->resolved = 1;
+    e->expires  = now + ((int_64)ttl * 1000000);
+
+    dnsfs_entry_render (e);
+}
+
+static struct dnsfs_label *dnsfs_label_create
+    (struct dnsfs_label *parent, const char *label)
+{
+    struct dnsfs_label *l = aalloc (sizeof (struct dnsfs_label));
+
+    memset (l, 0, sizeof (struct dnsfs_label));
+
+    l->parent   = parent;
+    l->label    = dnsfs_strdup (label);
+    l->children = tree_create ();
+
+    tree_add_node_string_value (parent->children, l->label, (void *)l);
+    parent->child_count++;
+
+    if ((parent->dir != (struct dfs_directory *)0) &&
+        (tree_get_node_string (parent->dir->nodes, l->label)
+             == (struct tree_node *)0))
+    {
+        l->dir = dnsfs_mk_directory (parent->dir, l->label);
+
+        l->dir->c.mode = 0550;
+        l->dir->c.uid  = "dnsfs";
+        l->dir->c.gid  = "dnsfs";
+    }
+
+    return l;
+}
+
+static struct dnsfs_label *dnsfs_label_find (const char *name, char create)
+{
+    struct dnsfs_label *l = &labels;
+    char label[64];
+    int end = strlen (name), start;
+
+    if ((end > 0) && (name[end-1] == '.'))
+    {
+        end--;
+    }
+
+    while (end > 0)
+    {
+        struct tree_node *node;
+
+        for (start = end; (start > 0) && (name[start-1] != '.'); start--);
+
+        if (((end - start) == 0) || ((end - start) > 63))
+        {
+            return (struct dnsfs_label *)0;
+        }
+
+        memcpy (label, name + start, end - start);
+        label[end - start] = 0;
+
+        if ((node = tree_get_node_string (l->children, label))
+                != (struct tree_node *)0)
+        {
+            l = (struct dnsfs_label *)node_get_value (node);
+        }
+        else if (create)
+        {
+            l = dnsfs_label_create (l, label);
+        }
+        else
+        {
+            return (struct dnsfs_label *)0;
+        }
+
+        end = start - 1;
+    }
+
+    return l;
+}
+
+static char dnsfs_in_zones (struct dfs_directory *d)
+{
+    if (zones == (struct dfs_directory *)0)
+    {
+        return 0;
+    }
+
+    while (d != zones)
+    {
+        if (d->parent == d)
+        {
+            return 0;
+        }
+
+        d = d->parent;
+    }
+
+    return 1;
+}
+
+static void dnsfs_label_prune (struct dnsfs_label *l)
+{
+    while ((l != &labels) && (l->entry == (struct dnsfs_entry *)0) &&
+           (l->child_count == 0))
+    {
+        struct dnsfs_label *parent = l->parent;
+
+        if ((l->dir != (struct dfs_directory *)0) &&
+            (parent->dir != (struct dfs_directory *)0))
+        {
+            tree_remove_node_string (parent->dir->nodes, l->label);
+            dnsfs_release_node (&(l->dir->c));
+        }
+
+        tree_remove_node_string (parent->children, l->label);
+        parent->child_count--;
+
+        tree_destroy (l->children);
+        afree (strlen (l->label) + 1, l->label);
+        afree (sizeof (struct dnsfs_label), l);
+
+        l = parent;
+    }
+}
+
+static void dnsfs_lru_unlink (struct dnsfs_entry *e)
+{
+    if (e->lru_prev != (struct dnsfs_entry *)0)
+    {
+        e->lru_prev->lru_next = e->lru_next;
+    }
+    else
+    {
+        lru_head = e->lru_next;
+    }
+
+    if (e->lru_next != (struct dnsfs_entry *)0)
+    {
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else
+    {
+        lru_tail = e->lru_prev;
+    }
+
+    e->lru_prev = (struct dnsfs_entry *)0;
+    e->lru_next = (struct dnsfs_entry *)0;
+}
+
+static void dnsfs_lru_push (struct dnsfs_entry *e)
+{
+    e->lru_prev = (struct dnsfs_entry *)0;
+    e->lru_next = lru_head;
+
+    if (lru_head != (struct dnsfs_entry *)0)
+    {
+        lru_head->lru_prev = e;
+    }
+    else
+    {
+        lru_tail = e;
+    }
+
+    lru_head = e;
+}
+
+static void dnsfs_order_unlink (struct dnsfs_entry *e)
+{
+    struct dnsfs_dump_cursor *c;
+
+    for (c = dump_cursors; c != (struct dnsfs_dump_cursor *)0; c = c->next)
+    {
+        if (c->entry == e)
+        {
+            c->entry = e->order_next;
+        }
+    }
+
+    if (e->order_prev != (struct dnsfs_entry *)0)
+    {
+        e->order_prev->order_next = e->order_next;
+    }
+    else
+    {
+        order_head = e->order_next;
+    }
+
+    if (e->order_next != (struct dnsfs_entry *)0)
+    {
+        e->order_next->order_prev = e->order_prev;
+    }
+    else
+    {
+        order_tail = e->order_prev;
+    }
+}
+
+static void dnsfs_drop_file
+    (struct dnsfs_entry *e, struct dfs_file *f, char *name)
+{
+    if (f == (struct dfs_file *)0)
+    {
+        return;
+    }
+
+    tree_remove_node_string (e->dir->nodes, name);
+
+    if (f->data != (int_8 *)0)
+    {
+        afree (f->c.length, f->data);
+    }
+
+    f->data     = (int_8 *)0;
+    f->c.length = 0;
+    f->aux      = (void *)0;
+
+    dnsfs_release_node (&(f->c));
+}
+
+/* the dfs nodes of a dropped name are unlinked, and freed as soon as no
+ * fid holds them any more; a name that is still being resolved is only
+ * marked, its lookup's answer is discarded and the name dropped then */
+static void dnsfs_entry_drop (struct dnsfs_entry *e)
+{
+    struct dnsfs_label *l = e->label;
+
+    if (e->lookup != (struct dnsfs_lookup *)0)
+    {
+        e->expires = 0;
+        e->flushed = 1;
+        return;
+    }
+
+    tree_remove_node_string (e->dir->parent->nodes, e->name);
+    tree_remove_node_string (entries, e->name);
+
+    dnsfs_lru_unlink (e);
+    dnsfs_order_unlink (e);
+    cache_size--;
+
+    dnsfs_drop_file (e, e->ip4, "ip4");
+    dnsfs_drop_file (e, e->ip6, "ip6");
+    dnsfs_drop_file (e, e->best, "best");
+    tree_remove_node (entry_dirs, (int_pointer)e->dir);
+    dnsfs_release_node (&(e->dir->c));
+
+    if (l != (struct dnsfs_label *)0)
+    {
+        if (l->dir != (struct dfs_directory *)0)
+        {
+            tree_remove_node_string (l->dir->nodes, DNSFS_LABEL_FILES);
+            tree_remove_node (entry_dirs, (int_pointer)l->dir);
+        }
+
+        l->entry = (struct dnsfs_entry *)0;
+        dnsfs_label_prune (l);
+    }
+
+    if (e->a4 != (unsigned char *)0)
+    {
+        afree (e->n4 * 4, e->a4);
+    }
+
+    if (e->a6 != (unsigned char *)0)
+    {
+        afree (e->n6 * 16, e->a6);
+    }
+
+    afree (strlen (e->name) + 1, e->name);
+    afree (sizeof (struct dnsfs_entry), e);
+}
+
+static void dnsfs_cache_trim (struct dnsfs_entry *keep)
+{
+    struct dnsfs_entry *e = lru_tail, *prev;
+
+    while ((cache_limit > 0) && (cache_size > cache_limit) &&
+           (e != (struct dnsfs_entry *)0))
+    {
+        prev = e->lru_prev;
+
+        if ((e != keep) && (e->lookup == (struct dnsfs_lookup *)0))
+        {
+            dnsfs_entry_drop (e);
+        }
+
+        e = prev;
+    }
+}
+
+/* names always live directly under the root, whichever directory they
+ * were created from, so that dropping one never strands another; names
+ * that would clash with dnsfs/ or zones/ there are refused */
+static struct dnsfs_entry *dnsfs_entry_get (char *name)
+{
+    struct tree_node *node = tree_get_node_string (entries, name);
+    struct dnsfs_entry *e;
+
+    if (node != (struct tree_node *)0)
+    {
+        return (struct dnsfs_entry *)node_get_value (node);
+    }
+
+    if (tree_get_node_string (names_root->nodes, name)
+            != (struct tree_node *)0)
+    {
+        return (struct dnsfs_entry *)0;
+    }
+
+    e = aalloc (sizeof (struct dnsfs_entry));
+    memset (e, 0, sizeof (struct dnsfs_entry));
+
+    e->name = dnsfs_strdup (name);
+    e->dir  = dnsfs_mk_directory (names_root, name);
+
+    e->dir->c.mode = 0550;
+    e->dir->c.uid  = "dnsfs";
+    e->dir->c.gid  = "dnsfs";
+
+    if (((e->label = dnsfs_label_find (name, 1)) != (struct dnsfs_label *)0) &&
+        (e->label->entry == (struct dnsfs_entry *)0))
+    {
+        e->label->entry = e;
+
+        if (e->label->dir != (struct dfs_directory *)0)
+        {
+            tree_add_node_string_value (e->label->dir->nodes,
+                                        DNSFS_LABEL_FILES, (void *)e->dir);
+            tree_add_node_value (entry_dirs, (int_pointer)e->label->dir,
+                                 (void *)e);
+        }
+    }
+    else
+    {
+        e->label = (struct dnsfs_label *)0;
+    }
+
+    tree_add_node_string_value (entries, e->name, (void *)e);
+    tree_add_node_value (entry_dirs, (int_pointer)e->dir, (void *)e);
+
+    dnsfs_lru_push (e);
+    cache_size++;
+
+    e->order_prev = order_tail;
+
+    if (order_tail != (struct dnsfs_entry *)0)
+    {
+        order_tail->order_next = e;
+    }
+    else
+    {
+        order_head = e;
+    }
+
+    order_tail = e;
+
+    dnsfs_cache_trim (e);
+
+    return e;
+}
+
+static void dnsfs_address_lookup (struct dnsfs_entry *e, int_64 now)
+{
+    struct addrinfo *ai;
+    int r = getaddrinfo (e->name, (void *)0, (void *)0, &ai);
+
+    if (r == 0)
+    {
+        struct addrinfo *c = ai;
+        unsigned char a4[DNSFS_MAX_ADDRESSES][4];
+        unsigned char a6[DNSFS_MAX_ADDRESSES][16];
+        unsigned int n4 = 0, n6 = 0, i;
+
+        for (c = ai; c != (struct addrinfo *)0; c = c->ai_next)
+        {
+            struct sockaddr_in  *ip4;
+            struct sockaddr_in6 *ip6;
+
+            switch (c->ai_family)
+            {
+                case AF_INET:
+                    ip4 = (struct sockaddr_in *)c->ai_addr;
+
+                    for (i = 0; (i < n4) &&
+                                (memcmp (a4[i], &(ip4->sin_addr), 4) != 0); i++);
+
+                    if ((i == n4) && (n4 < DNSFS_MAX_ADDRESSES))
+                    {
+                        memcpy (a4[n4], &(ip4->sin_addr), 4);
+                        n4++;
+                    }
+                    break;
+                case AF_INET6:
+                    ip6 = (struct sockaddr_in6 *)c->ai_addr;
+
+                    for (i = 0; (i < n6) &&
+                                (memcmp (a6[i], &(ip6->sin6_addr), 16) != 0); i++);
+
+                    if ((i == n6) && (n6 < DNSFS_MAX_ADDRESSES))
+                    {
+                        memcpy (a6[n6], &(ip6->sin6_addr), 16);
+                        n6++;
+                    }
+                    break;
+            }
+        }
+
+        dnsfs_entry_set_addresses
+            (e, n4, (unsigned char *)a4, n6, (unsigned char *)a6,
+             DNSFS_DEFAULT_TTL, now);
+
+        freeaddrinfo (ai);
+    }
+}
+
+static void dnsfs_free_waiter (struct dnsfs_waiter *w)
+{
+    int_16 i;
+
+    if (w->names != (char **)0)
+    {
+        for (i = 0; i < w->c; i++)
+        {
+            afree (strlen (w->names[i]) + 1, w->names[i]);
+        }
+
+        afree (sizeof (char *) * w->c, w->names);
+    }
+
+    afree (sizeof (struct dnsfs_waiter), w);
+}
+
+static void dnsfs_reply_waiter
+    (struct dnsfs_entry *e, struct dnsfs_waiter *w, const char *error)
+{
+    struct d9r_qid qid = { QTDIR, 1, (int_64)(int_pointer)e->dir };
+
+    if (error != (const char *)0)
+    {
+        d9r_reply_error (w->io, w->tag, (char *)error, P9_EDONTCARE);
+    }
+    else if (w->type == dw_walk)
+    {
+        dnsfs_walk (w->io, w->tag, w->fid, w->afid, w->c, w->names, 0);
+    }
+    else
+    {
+        d9r_reply_create (w->io, w->tag, qid, 0x1000);
+    }
+}
+
+static void dnsfs_lookup_release
+    (struct dnsfs_lookup *l, const char *error)
+{
+    struct dnsfs_entry *e = l->entry;
+    struct dnsfs_waiter *w, *wn;
+    int_32 current = trace_current;
+    char deferred = trace_deferred;
+
+    e->lookup = (struct dnsfs_lookup *)0;
+
+    if (e->flushed && (error == (const char *)0))
+    {
+        error = "The name was flushed while being resolved.";
+    }
+
+    for (w = l->waiters; w != (struct dnsfs_waiter *)0; w = wn)
+    {
+        struct dnsfs_trace *t = dnsfs_trace_get (w->trace);
+
+        if (t != (struct dnsfs_trace *)0)
+        {
+            t->resolve_end = dnsfs_now ();
+        }
+
+        wn = w->next;
+
+        trace_current  = w->trace;
+        trace_deferred = 0;
+        dnsfs_reply_waiter (e, w, error);
+        dnsfs_trace_end ();
+
+        dnsfs_free_waiter (w);
+    }
+
+    trace_current  = current;
+    trace_deferred = deferred;
+
+    afree (sizeof (struct dnsfs_lookup), l);
+
+    if (e->flushed)
+    {
+        dnsfs_entry_drop (e);
+    }
+}
+
+static void dnsfs_queue_remove (struct dnsfs_lookup *l)
+{
+    struct dnsfs_queue *q = &(resolver_queue[l->priority]);
+    struct dnsfs_lookup **p, *prev = (struct dnsfs_lookup *)0;
+
+    for (p = &(q->head); *p != (struct dnsfs_lookup *)0; p = &((*p)->next))
+    {
+        if (*p == l)
+        {
+            *p = l->next;
+
+            if (q->tail == l)
+            {
+                q->tail = prev;
+            }
+
+            l->next = (struct dnsfs_lookup *)0;
+            q->depth--;
+            return;
+        }
+
+        prev = *p;
+    }
+}
+
+static void dnsfs_queue_append (struct dnsfs_lookup *l, int_64 now)
+{
+    struct dnsfs_queue *q = &(resolver_queue[l->priority]);
+
+    l->next           = (struct dnsfs_lookup *)0;
+    l->queue_deadline = now + q->timeout;
+
+    if (q->tail == (struct dnsfs_lookup *)0)
+    {
+        q->head = l;
+    }
+    else
+    {
+        q->tail->next = l;
+    }
+
+    q->tail = l;
+    q->depth++;
+
+    if (q->depth > q->max_depth)
+    {
+        q->max_depth = q->depth;
+    }
+}
+
+static void dnsfs_lookup_start (struct dnsfs_lookup *l, int_64 now)
+{
+    struct dnsfs_waiter *w;
+
+    for (w = l->waiters; w != (struct dnsfs_waiter *)0; w = w->next)
+    {
+        struct dnsfs_trace *t = dnsfs_trace_get (w->trace);
+
+        if (t != (struct dnsfs_trace *)0)
+        {
+            t->resolve_start = now;
+        }
+    }
+
+    l->active   = 1;
+    l->deadline = now + DNSFS_LOOKUP_TIMEOUT;
+    l->next     = lookups;
+    lookups     = l;
+
+    resolver_active++;
+
+    dnsfs_lookup_transmit (l, now);
+}
+
+static void dnsfs_dispatch (int_64 now)
+{
+    int p;
+
+    for (p = dp_interactive; p <= dp_bulk; p++)
+    {
+        struct dnsfs_queue *q = &(resolver_queue[p]);
+
+        while ((resolver_active < resolver_window) &&
+               (q->head != (struct dnsfs_lookup *)0))
+        {
+            struct dnsfs_lookup *l = q->head;
+            int_64 waited = now - l->queued;
+
+            dnsfs_queue_remove (l);
+
+            q->dequeued++;
+            q->wait += (waited - q->wait) / 8;
+
+            if (waited > q->max_wait)
+            {
+                q->max_wait = waited;
+            }
+
+            dnsfs_lookup_start (l, now);
+        }
+    }
+}
+
+static void dnsfs_lookup_complete (struct dnsfs_lookup *l, int_64 now)
+{
+    struct dnsfs_entry *e = l->entry;
+    struct dnsfs_lookup **p;
+    int a, q;
+
+    for (a = 0; a < l->attempts; a++)
+    {
+        struct dnsfs_upstream *u = l->attempt[a].upstream;
+        int_64 elapsed = now - l->attempt[a].sent;
+
+        if (l->attempt[a].fd >= 0)
+        {
+            close (l->attempt[a].fd);
+            l->attempt[a].fd = -1;
+        }
+
+        if (l->attempt[a].answered)
+        {
+            continue;
+        }
+
+        if (now >= l->deadline)
+        {
+            dnsfs_upstream_failure (u, now);
+        }
+        else if (u->samples == 0)
+        {
+            /* lost the race: we only know its answer would have been late */
+            u->srtt   = elapsed;
+            u->rttvar = elapsed / 2;
+            u->samples++;
+        }
+        else if (elapsed > u->srtt)
+        {
+            u->srtt += (elapsed - u->srtt) / 8;
+        }
+    }
+
+    for (p = &lookups; *p != (struct dnsfs_lookup *)0; p = &((*p)->next))
+    {
+        if (*p == l)
+        {
+            *p = l->next;
+            break;
+        }
+    }
+
+    resolver_active--;
+
+    if (l->answered && !e->flushed)
+    {
+        int_32 ttl = 0x7fffffff;
+
+        for (q = 0; q < 2; q++)
+        {
+            if (l->done[q] && ((q == 0) ? (l->n4 > 0) : (l->n6 > 0)) &&
+                (l->ttl[q] < ttl))
+            {
+                ttl = l->ttl[q];
+            }
+        }
+
+        if (ttl == 0x7fffffff)
+        {
+            ttl = DNSFS_NEGATIVE_TTL;
+        }
+
+        dnsfs_entry_set_addresses
+            (e, l->n4, (unsigned char *)l->a4, l->n6, (unsigned char *)l->a6,
+             ttl, now);
+    }
+
+    dnsfs_lookup_release (l, (const char *)0);
+
+    dnsfs_dispatch (now);
+}
+
+static struct dnsfs_lookup *dnsfs_resolve
+    (struct dnsfs_entry *e, enum dnsfs_priority priority, int_64 now)
+{
+    struct dnsfs_lookup *l = e->lookup;
+    int_32 id4, id6;
+
+    if (l != (struct dnsfs_lookup *)0)
+    {
+        if (!l->active && (priority < l->priority))
+        {
+            dnsfs_queue_remove (l);
+            l->priority = priority;
+            dnsfs_queue_append (l, now);
+        }
+
+        return l;
+    }
+
+    if ((resolver_active >= resolver_window) &&
+        (resolver_queue[priority].depth >= DNSFS_MAX_QUEUED))
+    {
+        resolver_queue[priority].rejected++;
+        return (struct dnsfs_lookup *)0;
+    }
+
+    if (((id4 = dnsfs_random_id ()) < 0) || ((id6 = dnsfs_random_id ()) < 0))
+    {
+        return (struct dnsfs_lookup *)0;
+    }
+
+    l = aalloc (sizeof (struct dnsfs_lookup));
+    memset (l, 0, sizeof (struct dnsfs_lookup));
+
+    l->entry    = e;
+    l->priority = priority;
+    l->queued   = now;
+    l->id[0]    = id4;
+    l->id[1]    = id6;
+    l->ttl[0]   = 0x7fffffff;
+    l->ttl[1]   = 0x7fffffff;
+    e->lookup   = l;
+
+    if (resolver_active < resolver_window)
+    {
+        dnsfs_lookup_start (l, now);
+    }
+    else
+    {
+        dnsfs_queue_append (l, now);
+    }
+
+    return l;
+}
+
+static void dnsfs_lookup_wait
+    (struct dnsfs_lookup *l, struct d9r_io *io, int_16 tag)
+{
+    struct dnsfs_waiter *w = aalloc (sizeof (struct dnsfs_waiter));
+
+    memset (w, 0, sizeof (struct dnsfs_waiter));
+
+    w->type    = dw_create;
+    w->io      = io;
+    w->tag     = tag;
+    w->trace   = dnsfs_trace_defer (l->active, dnsfs_now ());
+    w->next    = l->waiters;
+    l->waiters = w;
+
+    /* asked for again after a flush, so the answer is wanted after all */
+    l->entry->flushed = 0;
+}
+
+static void dnsfs_lookup_wait_walk
+    (struct dnsfs_lookup *l, struct d9r_io *io, int_16 tag, int_32 fid,
+     int_32 afid, int_16 c, char **names)
+{
+    struct dnsfs_waiter *w = aalloc (sizeof (struct dnsfs_waiter));
+    int_16 i;
+
+    memset (w, 0, sizeof (struct dnsfs_waiter));
+
+    w->type  = dw_walk;
+    w->io    = io;
+    w->tag   = tag;
+    w->fid   = fid;
+    w->afid  = afid;
+    w->c     = c;
+    w->names = aalloc (sizeof (char *) * c);
+
+    for (i = 0; i < c; i++)
+    {
+        w->names[i] = dnsfs_strdup (names[i]);
+    }
+
+    w->trace   = dnsfs_trace_defer (l->active, dnsfs_now ());
+    w->next    = l->waiters;
+    l->waiters = w;
+
+    /* asked for again after a flush, so the answer is wanted after all */
+    l->entry->flushed = 0;
+}
+
+/* drops the waiters of io for one tag, or for all tags if all is set */
+static void dnsfs_cancel_waiters_in
+    (struct dnsfs_lookup *l, struct d9r_io *io, int_16 tag, char all)
+{
+    for (; l != (struct dnsfs_lookup *)0; l = l->next)
+    {
+        struct dnsfs_waiter **p = &(l->waiters);
+
+        while (*p != (struct dnsfs_waiter *)0)
+        {
+            struct dnsfs_waiter *w = *p;
+
+            if ((w->io == io) && (all || (w->tag == tag)))
+            {
+                struct dnsfs_trace *t = dnsfs_trace_get (w->trace);
+
+                /* nobody is left to reply to, so the trace ends here */
+                if (t != (struct dnsfs_trace *)0)
+                {
+                    t->replied = dnsfs_now ();
+                }
+
+                *p = w->next;
+                dnsfs_free_waiter (w);
+            }
+            else
+            {
+                p = &(w->next);
+            }
+        }
+    }
+}
+
+static void dnsfs_cancel_waiters (struct d9r_io *io, int_16 tag, char all)
+{
+    dnsfs_cancel_waiters_in (lookups, io, tag, all);
+    dnsfs_cancel_waiters_in (resolver_queue[dp_interactive].head, io, tag, all);
+    dnsfs_cancel_waiters_in (resolver_queue[dp_bulk].head, io, tag, all);
+}
+
+/* only ever in the background, so never through getaddrinfo() */
+static void dnsfs_entry_refresh (struct dnsfs_entry *e, int_64 now)
+{
+    if (upstreams != (struct dnsfs_upstream *)0)
+    {
+        dnsfs_resolve (e, dp_bulk, now);
+    }
+}
+
+static void dnsfs_entry_touch (struct dnsfs_entry *e, int_64 now)
+{
+    if (lru_head != e)
+    {
+        dnsfs_lru_unlink (e);
+        dnsfs_lru_push (e);
+    }
+
+    if (o_prefetch && (upstreams != (struct dnsfs_upstream *)0) &&
+        (e->lookup == (struct dnsfs_lookup *)0) && (e->expires > now) &&
+        ((e->expires - now) <
+             (((int_64)e->ttl * 1000000) / DNSFS_PREFETCH)))
+    {
+        dnsfs_resolve (e, dp_bulk, now);
+    }
+}
+
+static char dnsfs_entry_usable (struct dnsfs_entry *e, int_64 now)
+{
+    if (e->expires > now)
+    {
+        return 1;
+    }
+
+    if (o_serve_stale && (upstreams != (struct dnsfs_upstream *)0) &&
+        e->resolved && (e->expires > 0) &&
+        ((now - e->expires) < DNSFS_MAX_STALE))
+    {
+        dnsfs_entry_refresh (e, now);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* d may be reached under any spelling of the name, or through zones/,
+ * so the entry is found from the directory itself */
+static char dnsfs_walk_defer
+    (struct d9r_io *io, int_16 tag, int_32 fid, int_32 afid, int_16 c,
+     char **names, struct dfs_directory *d)
+{
+    struct tree_node *node;
+    struct dnsfs_entry *e;
+    struct dnsfs_lookup *l;
+    int_64 now;
+
+    if ((node = tree_get_node (entry_dirs, (int_pointer)d))
+            == (struct tree_node *)0)
+    {
+        return 0;
+    }
+
+    e   = (struct dnsfs_entry *)node_get_value (node);
+    now = dnsfs_now ();
+
+    dnsfs_entry_touch (e, now);
+
+    if (dnsfs_entry_usable (e, now))
+    {
+        return 0;
+    }
+
+    /* getaddrinfo() cannot be waited on, so the walk blocks on it just
+     * like Tcreate does */
+    if (upstreams == (struct dnsfs_upstream *)0)
+    {
+        dnsfs_address_lookup (e, now);
+        return 0;
+    }
+
+    if ((l = dnsfs_resolve (e, dp_interactive, now)) == (struct dnsfs_lookup *)0)
+    {
+        d9r_reply_error (io, tag, "Resolver queue full.", P9_EDONTCARE);
+        return 1;
+    }
+
+    dnsfs_lookup_wait_walk (l, io, tag, fid, afid, c, names);
+
+    return 1;
+}
+
+struct dnsfs_subtree_map
+{
+    void  (*apply)(struct dnsfs_entry *, int_64);
+    int_64  now;
+};
+
+static void dnsfs_subtree_apply (struct dnsfs_label *, struct dnsfs_subtree_map *);
+
+static void dnsfs_subtree_node (struct tree_node *node, void *v)
+{
+    dnsfs_subtree_apply ((struct dnsfs_label *)node_get_value (node),
+                         (struct dnsfs_subtree_map *)v);
+}
+
+static void dnsfs_subtree_apply
+    (struct dnsfs_label *l, struct dnsfs_subtree_map *m)
+{
+    if (l->entry != (struct dnsfs_entry *)0)
+    {
+        m->apply (l->entry, m->now);
+    }
+
+    tree_map (l->children, dnsfs_subtree_node, (void *)m);
+}
+
+static void dnsfs_entry_invalidate (struct dnsfs_entry *e, int_64 now)
+{
+    e->expires = 0;
+}
+
+static const char *dnsfs_subtree
+    (sexpr args, void (*apply)(struct dnsfs_entry *, int_64))
+{
+    struct dnsfs_label *l;
+    struct dnsfs_subtree_map m = { .apply = apply, .now = dnsfs_now () };
+    char canonical[DNSFS_NAME_SIZE];
+
+    if (!consp (args) || !stringp (car (args)))
+    {
+        return "Expected a zone name.";
+    }
+
+    if (!dnsfs_canonical_name (canonical, sx_string (car (args))) ||
+        ((l = dnsfs_label_find (canonical, 0)) == (struct dnsfs_label *)0))
+    {
+        return "No such zone.";
+    }
+
+    dnsfs_subtree_apply (l, &m);
+
+    return (const char *)0;
+}
+
+/* without upstreams every name would block the loop in getaddrinfo(), so
+ * a zone can only be invalidated and resolved again on its next use */
+static const char *dnsfs_refresh (sexpr args)
+{
+    if (upstreams == (struct dnsfs_upstream *)0)
+    {
+        return "Refreshing needs a resolver; use invalidate instead.";
+    }
+
+    return dnsfs_subtree (args, dnsfs_entry_refresh);
+}
+
+static const char *dnsfs_flush (sexpr args)
+{
+    struct dnsfs_entry *e, *next;
+    struct tree_node *node;
+    char canonical[DNSFS_NAME_SIZE];
+
+    if (eolp (args))
+    {
+        for (e = lru_head; e != (struct dnsfs_entry *)0; e = next)
+        {
+            next = e->lru_next;
+            dnsfs_entry_drop (e);
+        }
+
+        return (const char *)0;
+    }
+
+    if (!consp (args) || !stringp (car (args)))
+    {
+        return "Expected a name.";
+    }
+
+    if (!dnsfs_canonical_name (canonical, sx_string (car (args))) ||
+        ((node = tree_get_node_string (entries, canonical))
+             == (struct tree_node *)0))
+    {
+        return "No such name.";
+    }
+
+    dnsfs_entry_drop ((struct dnsfs_entry *)node_get_value (node));
+
+    return (const char *)0;
+}
+
+static const char *dnsfs_set_ttl (sexpr args, char ceiling)
+{
+    int_32 ttl;
+
+    if (!consp (args) || !integerp (car (args)) ||
+        (sx_integer (car (args)) < 0) ||
+        (sx_integer (car (args)) > 0x7fffffff))
+    {
+        return "Expected a TTL in seconds.";
+    }
+
+    ttl = (int_32)sx_integer (car (args));
+
+    if (ceiling ? (ttl < ttl_floor) : (ttl > ttl_ceiling))
+    {
+        return "The TTL floor must not exceed the ceiling.";
+    }
+
+    if (ceiling)
+    {
+        ttl_ceiling = ttl;
+    }
+    else
+    {
+        ttl_floor = ttl;
+    }
+
+    return (const char *)0;
+}
+
+static const char *dnsfs_set_cache_limit (sexpr args)
+{
+    if (!consp (args) || !integerp (car (args)) ||
+        (sx_integer (car (args)) < 0) ||
+        (sx_integer (car (args)) > 0x7fffffff))
+    {
+        return "Expected a number of names, or 0 for no limit.";
+    }
+
+    cache_limit = (int_32)sx_integer (car (args));
+
+    dnsfs_cache_trim ((struct dnsfs_entry *)0);
+
+    return (const char *)0;
+}
+
+static const char *dnsfs_set_flag (sexpr args, char *flag)
+{
+    if (!consp (args) || !(truep (car (args)) || falsep (car (args))))
+    {
+        return "Expected #t or #f.";
+    }
+
+    *flag = truep (car (args)) ? 1 : 0;
+
+    return (const char *)0;
+}
+
+/* stale names are refreshed behind the reply, which getaddrinfo() can't
+ * do, so serving them needs upstreams; dropping those turns it off */
+static const char *dnsfs_set_serve_stale (sexpr args)
+{
+    if (consp (args) && truep (car (args)) &&
+        (upstreams == (struct dnsfs_upstream *)0))
+    {
+        return "Serving stale names needs a resolver.";
+    }
+
+    return dnsfs_set_flag (args, &o_serve_stale);
+}
+
+static const char *dnsfs_set_trace_sample (sexpr args)
+{
+    if (!consp (args) || !integerp (car (args)) ||
+        (sx_integer (car (args)) < 0) ||
+        (sx_integer (car (args)) > 0x7fffffff))
+    {
+        return "Expected n to trace one in n requests, or 0 for none.";
+    }
+
+    trace_sample    = (int_32)sx_integer (car (args));
+    trace_countdown = 0;
+
+    return (const char *)0;
+}
+
+static void dnsfs_close_retired ()
+{
+    struct dnsfs_upstream *u;
+
+    while ((u = retired) != (struct dnsfs_upstream *)0)
+    {
+        retired = u->next;
+        dnsfs_upstream_close (u);
+    }
+}
+
+/* lookups in flight may still point at the old upstreams, so those are
+ * only closed once the resolver is idle */
+static const char *dnsfs_set_upstreams (sexpr args)
+{
+    struct dnsfs_upstream *list = (struct dnsfs_upstream *)0, **tail = &list;
+    struct dnsfs_upstream *u;
+    sexpr c;
+
+    for (c = args; consp (c); c = cdr (c))
+    {
+        if (!stringp (car (c)) ||
+            ((u = dnsfs_upstream_open (sx_string (car (c))))
+                 == (struct dnsfs_upstream *)0))
+        {
+            while ((u = list) != (struct dnsfs_upstream *)0)
+            {
+                list = u->next;
+                dnsfs_upstream_close (u);
+            }
+
+            return "Invalid upstream resolver.";
+        }
+
+        *tail = u;
+        tail  = &(u->next);
+    }
+
+    for (tail = &retired; *tail != (struct dnsfs_upstream *)0;
+         tail = &((*tail)->next));
+
+    *tail     = upstreams;
+    upstreams = list;
+
+    if (upstreams == (struct dnsfs_upstream *)0)
+    {
+        o_serve_stale = 0;
+    }
+
+    if (lookups == (struct dnsfs_lookup *)0)
+    {
+        dnsfs_close_retired ();
+    }
+
+    return (const char *)0;
+}
+
+/* returns 1 once the lookup is complete, and so gone */
+static char dnsfs_handle_response
+    (struct dnsfs_lookup *l, int a, const unsigned char *b, int len,
+     int_64 now)
+{
+    struct dnsfs_upstream *u = l->attempt[a].upstream;
+    int_32 id;
+    int q, i, p, count, rcode;
+
+    if ((len < 12) || ((b[2] & 0x80) == 0))
+    {
+        return 0;
+    }
+
+    id = ((int_32)b[0] << 8) | (int_32)b[1];
+
+    for (q = 0; (q < 2) && ((l->id[q] != id) || l->done[q]); q++);
+
+    if ((q == 2) || (b[4] != 0) || (b[5] != 1) ||
+        !dnsfs_question_matches (b, len, l->entry->name,
+                                 (q == 0) ? DNS_TYPE_A : DNS_TYPE_AAAA))
+    {
+        return 0;
+    }
+
+    rcode = b[3] & 0x0f;
+
+    if (b[2] & 0x02)
+    {
+        /* truncated: the answer is incomplete, so it must not be cached */
+        if (l->attempts < DNSFS_MAX_ATTEMPTS)
+        {
+            l->next_attempt = now;
+        }
+        return 0;
+    }
+
+    if ((rcode != 0) && (rcode != DNS_RCODE_NXDOMAIN))
+    {
+        /* SERVFAIL, REFUSED and friends: let the next upstream have a go */
+        dnsfs_upstream_failure (u, now);
+
+        if (l->attempts < DNSFS_MAX_ATTEMPTS)
+        {
+            l->next_attempt = now;
+        }
+        return 0;
+    }
+
+    p = dnsfs_skip_name (b, len, 12);
+
+    if ((p < 0) || ((p + 4) > len))
+    {
+        return 0;
+    }
+
+    p    += 4;
+    count = ((int)b[6] << 8) | (int)b[7];
+
+    for (i = 0; (rcode == 0) && (i < count); i++)
+    {
+        int type, rdlength;
+        unsigned long ttl;
+
+        p = dnsfs_skip_name (b, len, p);
+
+        if ((p < 0) || ((p + 10) > len))
+        {
+            break;
+        }
+
+        type     = ((int)b[p] << 8) | (int)b[p+1];
+        ttl      = ((unsigned long)b[p+4] << 24) | ((unsigned long)b[p+5] << 16) |
+                   ((unsigned long)b[p+6] << 8)  |  (unsigned long)b[p+7];
+        rdlength = ((int)b[p+8] << 8) | (int)b[p+9];
+        p       += 10;
+
+        if ((p + rdlength) > len)
+        {
+            break;
+        }
+
+        if (ttl > 0x7fffffff)
+        {
+            ttl = 0;
+        }
+
+        if ((q == 0) && (type == DNS_TYPE_A) && (rdlength == 4) &&
+            (l->n4 < DNSFS_MAX_ADDRESSES))
+        {
+            memcpy (l->a4[l->n4], b + p, 4);
+            l->n4++;
+        }
+        else if ((q == 1) && (type == DNS_TYPE_AAAA) && (rdlength == 16) &&
+                 (l->n6 < DNSFS_MAX_ADDRESSES))
+        {
+            memcpy (l->a6[l->n6], b + p, 16);
+            l->n6++;
+        }
+
+        if ((int_32)ttl < l->ttl[q])
+        {
+            l->ttl[q] = (int_32)ttl;
+        }
+
+        p += rdlength;
+    }
+
+    /* only answers that are used count towards the upstream's health */
+    dnsfs_upstream_sample (u, now - l->attempt[a].sent);
+
+    l->done[q]              = 1;
+    l->answered             = 1;
+    l->attempt[a].answered  = 1;
+    u->wins++;
+
+    if (l->done[0] && l->done[1])
+    {
+        dnsfs_lookup_complete (l, now);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void dnsfs_attempt_read (struct dnsfs_lookup *l, int a, int_64 now)
+{
+    unsigned char packet[DNSFS_PACKET_SIZE];
+
+    for (;;)
+    {
+        ssize_t r = recv (l->attempt[a].fd, packet, sizeof (packet), 0);
+
+        if (r >= 0)
+        {
+            if (dnsfs_handle_response (l, a, packet, (int)r, now))
+            {
+                break;
+            }
+        }
+        else if (errno == ECONNREFUSED)
+        {
+            dnsfs_upstream_failure (l->attempt[a].upstream, now);
+
+            if ((a == (l->attempts - 1)) && (l->attempts < DNSFS_MAX_ATTEMPTS))
+            {
+                l->next_attempt = now;
+            }
+        }
+        else if (errno != EINTR)
+        {
+            break;
+        }
+    }
+}
+
+static void dnsfs_resolver_tick (int_64 now)
+{
+    struct dnsfs_lookup *l = lookups, *n;
+    int p;
+
+    while (l != (struct dnsfs_lookup *)0)
+    {
+        n = l->next;
+
+        if (now >= l->deadline)
+        {
+            dnsfs_lookup_complete (l, now);
+        }
+        else if (now >= l->next_attempt)
+        {
+            dnsfs_lookup_transmit (l, now);
+        }
+
+        l = n;
+    }
+
+    for (p = dp_interactive; p <= dp_bulk; p++)
+    {
+        for (l = resolver_queue[p].head; l != (struct dnsfs_lookup *)0; l = n)
+        {
+            n = l->next;
+
+            if (now >= l->queue_deadline)
+            {
+                dnsfs_queue_remove (l);
+                resolver_queue[p].expired++;
+
+                dnsfs_lookup_release (l, "Resolver queue deadline exceeded.");
+            }
+        }
+    }
+
+    dnsfs_dispatch (now);
+
+    if (lookups == (struct dnsfs_lookup *)0)
+    {
+        dnsfs_close_retired ();
+    }
+
+    if (probe_port > 0)
+    {
+        dnsfs_probe_tick (now);
+    }
+}
+
+static char dnsfs_resolver_busy ()
+{
+    return (lookups != (struct dnsfs_lookup *)0) ||
+           (resolver_queue[dp_interactive].head != (struct dnsfs_lookup *)0) ||
+           (resolver_queue[dp_bulk].head != (struct dnsfs_lookup *)0) ||
+           dnsfs_probe_busy ();
+}
+
+static enum multiplex_result mx_resolver_poll ()
+{
+    return dnsfs_resolver_busy () ? mx_ok : mx_nothing_to_do;
+}
+
+static void mx_resolver_count (int *r, int *w)
+{
+    struct dnsfs_lookup *l;
+    int i;
+
+    if (!dnsfs_resolver_busy ())
+    {
+        return;
+    }
+
+    for (l = lookups; l != (struct dnsfs_lookup *)0; l = l->next)
+    {
+        for (i = 0; i < l->attempts; i++)
+        {
+            if (l->attempt[i].fd >= 0)
+            {
+                (*r)++;
+            }
+        }
+    }
+
+    for (i = 0; i < DNSFS_PROBE_PARALLEL; i++)
+    {
+        if (probe_active[i] != (struct dnsfs_probe *)0)
+        {
+            (*w)++;
+        }
+    }
+
+    if (resolver_timer != -1)
+    {
+        (*r)++;
+    }
+}
+
+static void mx_resolver_augment (int *rs, int *r, int *ws, int *w)
+{
+    struct dnsfs_lookup *l;
+    int p;
+
+    if (!dnsfs_resolver_busy ())
+    {
+        return;
+    }
+
+    for (l = lookups; l != (struct dnsfs_lookup *)0; l = l->next)
+    {
+        for (p = 0; p < l->attempts; p++)
+        {
+            if (l->attempt[p].fd >= 0)
+            {
+                rs[*r] = l->attempt[p].fd;
+                (*r)++;
+            }
+        }
+    }
+
+    for (p = 0; p < DNSFS_PROBE_PARALLEL; p++)
+    {
+        if (probe_active[p] != (struct dnsfs_probe *)0)
+        {
+            ws[*w] = probe_active[p]->fd;
+            (*w)++;
+        }
+    }
+
+    if (resolver_timer != -1)
+    {
+        struct itimerspec its;
+        int_64 next = 0x7fffffffffffffffLL;
+
+        for (l = lookups; l != (struct dnsfs_lookup *)0; l = l->next)
+        {
+            if (l->next_attempt < next) next = l->next_attempt;
+            if (l->deadline     < next) next = l->deadline;
+        }
+
+        for (p = dp_interactive; p <= dp_bulk; p++)
+        {
+            for (l = resolver_queue[p].head; l != (struct dnsfs_lookup *)0;
+                 l = l->next)
+            {
+                if (l->queue_deadline < next) next = l->queue_deadline;
+            }
+        }
+
+        next = dnsfs_probe_deadline (next);
+
+        if (next < 1)
+        {
+            next = 1;
+        }
+
+        memset (&its, 0, sizeof (its));
+        its.it_value.tv_sec  = (time_t)(next / 1000000);
+        its.it_value.tv_nsec = (long)((next % 1000000) * 1000);
+
+        timerfd_settime (resolver_timer, TFD_TIMER_ABSTIME, &its,
+                         (struct itimerspec *)0);
+
+        rs[*r] = resolver_timer;
+        (*r)++;
+    }
+}
+
+static void mx_resolver_callback (int *rs, int r, int *ws, int w)
+{
+    struct dnsfs_lookup *l;
+    int_64 now = dnsfs_now ();
+    int i;
+
+    for (i = 0; i < r; i++)
+    {
+        if (rs[i] == resolver_timer)
+        {
+            unsigned char expirations[8];
+
+            if (read (resolver_timer, expirations, sizeof (expirations)) < 0)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            for (l = lookups; l != (struct dnsfs_lookup *)0; l = l->next)
+            {
+                int a;
+
+                for (a = 0; (a < l->attempts) && (l->attempt[a].fd != rs[i]);
+                     a++);
+
+                if (a < l->attempts)
+                {
+                    dnsfs_attempt_read (l, a, now);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < w; i++)
+    {
+        int j;
+
+        for (j = 0; j < DNSFS_PROBE_PARALLEL; j++)
+        {
+            if ((probe_active[j] != (struct dnsfs_probe *)0) &&
+                (probe_active[j]->fd == ws[i]))
+            {
+                dnsfs_probe_connected (probe_active[j], now);
+            }
+        }
+    }
+
+    dnsfs_resolver_tick (now);
+}
+
+static void multiplex_resolver ()
+{
+    static struct multiplex_functions mx_functions =
+    {
+        .poll     = mx_resolver_poll,
+        .count    = mx_resolver_count,
+        .augment  = mx_resolver_augment,
+        .callback = mx_resolver_callback,
+        .next     = (struct multiplex_functions *)0
+    };
+
+    resolver_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    multiplex_add (&mx_functions);
+}
+
+static void on_upstreams_read
+    (struct d9r_io *io, int_16 tag, struct dfs_file *f, int_64 offset,
+     int_32 length)
+{
+    struct io       *b    = io_open_special ();
+    struct sexpr_io *b_sx = sx_open_o (b);
+    struct dnsfs_upstream *u;
+    int_64 now = dnsfs_now ();
+
+    for (u = upstreams; u != (struct dnsfs_upstream *)0; u = u->next)
+    {
+        sx_write (b_sx,
+                  cons (sym_upstream,
+                  cons (make_string (u->name),
+                  cons (cons (sym_healthy,
+                              cons (dnsfs_upstream_healthy (u, now)
+                                        ? sx_true : sx_false,
+                                    sx_end_of_list)),
+                  cons (dnsfs_pair (sym_srtt,         u->srtt),
+                  cons (dnsfs_pair (sym_rttvar,       u->rttvar),
+                  cons (dnsfs_pair (sym_failure_rate, u->failrate),
+                  cons (dnsfs_pair (sym_queries,      u->queries),
+                  cons (dnsfs_pair (sym_answers,      u->answers),
+                  cons (dnsfs_pair (sym_failures,     u->failures),
+                  cons (dnsfs_pair (sym_hedges,       u->hedges),
+                  cons (dnsfs_pair (sym_wins,         u->wins),
+                        sx_end_of_list))))))))))));
+    }
+
+    dnsfs_reply_buffer (io, tag, offset, length, b);
+
+    sx_close_io (b_sx);
+}
+
+static sexpr dnsfs_queue_sx (sexpr name, struct dnsfs_queue *q)
+{
+    return cons (name,
+           cons (dnsfs_pair (sym_depth,     q->depth),
+           cons (dnsfs_pair (sym_max_depth, q->max_depth),
+           cons (dnsfs_pair (sym_wait,      q->wait),
+           cons (dnsfs_pair (sym_max_wait,  q->max_wait),
+           cons (dnsfs_pair (sym_dequeued,  q->dequeued),
+           cons (dnsfs_pair (sym_expired,   q->expired),
+           cons (dnsfs_pair (sym_rejected,  q->rejected),
+                 sx_end_of_list))))))));
+}
+
+static void on_queue_read
+    (struct d9r_io *io, int_16 tag, struct dfs_file *f, int_64 offset,
+     int_32 length)
+{
+    struct io       *b    = io_open_special ();
+    struct sexpr_io *b_sx = sx_open_o (b);
+
+    sx_write (b_sx, dnsfs_pair (sym_window,    resolver_window));
+    sx_write (b_sx, dnsfs_pair (sym_in_flight, resolver_active));
+    sx_write (b_sx, dnsfs_queue_sx (sym_interactive,
+                                    &(resolver_queue[dp_interactive])));
+    sx_write (b_sx, dnsfs_queue_sx (sym_bulk, &(resolver_queue[dp_bulk])));
+
+    dnsfs_reply_buffer (io, tag, offset, length, b);
+
+    sx_close_io (b_sx);
+}
+
+static sexpr dnsfs_upstream_names (struct dnsfs_upstream *u)
+{
+    return (u == (struct dnsfs_upstream *)0) ? sx_end_of_list :
+           cons (make_string (u->name), dnsfs_upstream_names (u->next));
+}
+
+static void on_status_read
+    (struct d9r_io *io, int_16 tag, struct dfs_file *f, int_64 offset,
+     int_32 length)
+{
+    struct io       *b    = io_open_special ();
+    struct sexpr_io *b_sx = sx_open_o (b);
+
+    sx_write (b_sx,
+              cons (sym_last,
+              cons (make_string (status_command),
+              cons ((status_error == (const char *)0) ? sym_ok :
+                        cons (sym_error,
+                              cons (make_string (status_error),
+                                    sx_end_of_list)),
+                    sx_end_of_list))));
+    sx_write (b_sx, dnsfs_pair (sym_ttl_floor,   ttl_floor));
+    sx_write (b_sx, dnsfs_pair (sym_ttl_ceiling, ttl_ceiling));
+    sx_write (b_sx, dnsfs_pair (sym_cache_limit, cache_limit));
+    sx_write (b_sx, dnsfs_pair (sym_cache_size,  cache_size));
+    sx_write (b_sx, cons (sym_prefetch,
+                          cons (o_prefetch ? sx_true : sx_false,
+                                sx_end_of_list)));
+    sx_write (b_sx, cons (sym_serve_stale,
+                          cons (o_serve_stale ? sx_true : sx_false,
+                                sx_end_of_list)));
+    sx_write (b_sx, cons (sym_upstreams, dnsfs_upstream_names (upstreams)));
+    sx_write (b_sx, dnsfs_pair (sym_trace_sample, trace_sample));
+    sx_write (b_sx, dnsfs_pair (sym_imported, imported));
+    sx_write (b_sx, dnsfs_pair (sym_import_rejected, import_rejected));
+
+    dnsfs_reply_buffer (io, tag, offset, length, b);
+
+    sx_close_io (b_sx);
+}
+
+static void dnsfs_dump_reset (struct dnsfs_dump_cursor *c)
+{
+    if (c->buffer != (char *)0)
+    {
+        afree (c->length, c->buffer);
+    }
+
+    c->entry  = order_head;
+    c->offset = 0;
+    c->buffer = (char *)0;
+    c->length = 0;
+}
+
+static void dnsfs_dump_consume (struct dnsfs_dump_cursor *c, unsigned int n)
+{
+    char *buffer = (char *)0;
+
+    if (n >= c->length)
+    {
+        n = c->length;
+    }
+    else
+    {
+        buffer = aalloc (c->length - n);
+        memcpy (buffer, c->buffer + n, c->length - n);
+    }
+
+    if (c->buffer != (char *)0)
+    {
+        afree (c->length, c->buffer);
+    }
+
+    c->buffer  = buffer;
+    c->length -= n;
+    c->offset += n;
+}
+
+/* renders the next cached name with some TTL left; 0 at the end */
+static char dnsfs_dump_next (struct dnsfs_dump_cursor *c, int_64 now)
+{
+    while (c->entry != (struct dnsfs_entry *)0)
+    {
+        struct dnsfs_entry *e = c->entry;
+
+        c->entry = e->order_next;
+
+        if (e->resolved && (e->expires > now))
+        {
+            struct io       *b    = io_open_special ();
+            struct sexpr_io *b_sx = sx_open_o (b);
+            sexpr records = sx_end_of_list;
+            unsigned int i;
+            char *buffer;
+
+            for (i = e->n6; i > 0; i--)
+            {
+                records = cons (cons (sym_ip6,
+                                      dnsfs_bytes_sx (e->a6 + ((i-1) * 16), 16)),
+                                records);
+            }
+
+            for (i = e->n4; i > 0; i--)
+            {
+                records = cons (cons (sym_ip4,
+                                      dnsfs_bytes_sx (e->a4 + ((i-1) * 4), 4)),
+                                records);
+            }
+
+            sx_write (b_sx,
+                      cons (sym_entry,
+                      cons (make_string (e->name),
+                      cons (make_integer
+                                ((e->expires - now + 999999) / 1000000),
+                            records))));
+
+            buffer = aalloc (c->length + b->length);
+
+            if (c->buffer != (char *)0)
+            {
+                memcpy (buffer, c->buffer, c->length);
+                afree (c->length, c->buffer);
+            }
+
+            memcpy (buffer + c->length, b->buffer, b->length);
+
+            c->buffer  = buffer;
+            c->length += b->length;
+
+            sx_close_io (b_sx);
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void on_dump_read
+    (struct d9r_io *io, int_16 tag, struct dfs_file *f, int_64 offset,
+     int_32 length)
+{
+    struct dnsfs_dump_cursor *c;
+    int_64 now = dnsfs_now ();
+
+    for (c = dump_cursors; (c != (struct dnsfs_dump_cursor *)0) &&
+                           ((c->io != io) || (c->fid != read_fid));
+         c = c->next);
+
+    if (c == (struct dnsfs_dump_cursor *)0)
+    {
+        c = aalloc (sizeof (struct dnsfs_dump_cursor));
+        memset (c, 0, sizeof (struct dnsfs_dump_cursor));
+
+        c->io        = io;
+        c->fid       = read_fid;
+        c->entry     = order_head;
+        c->next      = dump_cursors;
+        dump_cursors = c;
+    }
+
+    if (offset < c->offset)
+    {
+        dnsfs_dump_reset (c);
+    }
+
+    while ((int_64)(c->offset + c->length) < (offset + length))
+    {
+        if (!dnsfs_dump_next (c, now))
+        {
+            break;
+        }
+
+        if ((int_64)(c->offset + c->length) <= offset)
+        {
+            dnsfs_dump_consume (c, c->length);
+        }
+    }
+
+    if (offset >= (int_64)(c->offset + c->length))
+    {
+        d9r_reply_read (io, tag, 0, (int_8 *)0);
+        return;
+    }
+
+    dnsfs_dump_consume (c, (unsigned int)(offset - c->offset));
+
+    if ((unsigned int)length > c->length)
+    {
+        length = (int_32)c->length;
+    }
+
+    d9r_reply_read (io, tag, length, (int_8 *)c->buffer);
+
+    dnsfs_dump_consume (c, (unsigned int)length);
+}
+
+/* drops the cursors of one fid, or of all fids of io if all is set */
+static void dnsfs_dump_close (struct d9r_io *io, int_32 fid, char all)
+{
+    struct dnsfs_dump_cursor **p = &dump_cursors, *c;
+
+    while ((c = *p) != (struct dnsfs_dump_cursor *)0)
+    {
+        if ((c->io == io) && (all || (c->fid == fid)))
+        {
+            *p = c->next;
+
+            if (c->buffer != (char *)0)
+            {
+                afree (c->length, c->buffer);
+            }
+
+            afree (sizeof (struct dnsfs_dump_cursor), c);
+        }
+        else
+        {
+            p = &(c->next);
+        }
+    }
+}
+
+static void dnsfs_create (struct d9r_io *io, int_16 tag, int_32 fid, char *name, int_32 perm, int_8 mode, char *ext)
+{
+    struct d9r_fid_metadata *md = d9r_fid_metadata (io, fid);
+    struct dfs_node_common *c = md->aux;
+    struct dfs_directory *d;
+    struct d9r_qid qid = { 0, 1, 2 };
+
+    if (c->type != dft_directory)
+    {
+        d9r_reply_error (io, tag,
+                         "Cannot create nodes under anything but a directory.",
+                         P9_EDONTCARE);
+        return;
+    }
+
+    d = (struct dfs_directory *)c;
+
+    if (dnsfs_in_zones (d))
+    {
+        d9r_reply_error (io, tag, "The zone view is read-only.", P9_EDONTCARE);
+        return;
+    }
+
+    if (perm & DMDIR)
+    {
+        struct dnsfs_entry *e;
+        int_64 now = dnsfs_now ();
+        char canonical[DNSFS_NAME_SIZE];
+
+        if (!dnsfs_canonical_name (canonical, name))
+        {
+            d9r_reply_error (io, tag, "Invalid host name.", P9_EDONTCARE);
+            return;
+        }
+
+        if ((e = dnsfs_entry_get (canonical)) == (struct dnsfs_entry *)0)
+        {
+            d9r_reply_error (io, tag, "Reserved name.", P9_EDONTCARE);
+            return;
+        }
+
+        dnsfs_entry_touch (e, now);
+
+        if (!dnsfs_entry_usable (e, now))
+        {
+            if (upstreams == (struct dnsfs_upstream *)0)
+            {
+                dnsfs_address_lookup (e, now);
+            }
+            else
+            {
+                struct dnsfs_lookup *l = dnsfs_resolve (e, dp_interactive, now);
+
+                if (l == (struct dnsfs_lookup *)0)
+                {
+                    d9r_reply_error (io, tag, "Resolver queue full.",
+                                     P9_EDONTCARE);
+                    return;
+                }
+
+                dnsfs_lookup_wait (l, io, tag);
+                return;
+            }
+        }
+
+        qid.type = QTDIR;
+        qid.path = (int_64)(int_pointer)e->dir;
+    }
+    else if (perm & DMSYMLINK)
+    {
+        qid.type = QTLINK;
+        qid.path = (int_64)(int_pointer)dfs_mk_symlink(d, name, ext);
+    }
+    else if (perm & DMSOCKET)
+    {
+        qid.path = (int_64)(int_pointer)dfs_mk_socket(d, name);
+    }
+    else if (perm & DMNAMEDPIPE)
+    {
+        qid.path = (int_64)(int_pointer)dfs_mk_pipe(d, name);
+    }
+    else if (perm & DMDEVICE)
+    {
+        int_16 majour = 0, minor = 0, i = 1;
+
+        if ((ext == (char *)0) || (ext[0] == (char)0) || (ext[1] == (char)0) ||
+            ((ext[0] != 'c') && (ext[0] != 'b')))
+        {
+            d9r_reply_error (io, tag, "Invalid Tcreate Message.", P9_EDONTCARE);
+            return;
+        }
+
+        while (ext[i] == ' ') i++;
+
+        while (ext[i] && (ext[i] != ' '))
+        {
+            majour *= 10;
+            majour += (char)(ext[i] - '0');
+            i++;
+        }
+
+        while (ext[i] == ' ') i++;
+
+        while (ext[i])
+        {
+            minor *= 10;
+            minor += (char)(ext[i] - '0');
+            i++;
+        }
+
+        qid.path = (int_64)(int_pointer)dfs_mk_device
+                (d, name,
+                 (ext[0] == 'b') ? dfs_block_device : dfs_character_device,
+                  majour, minor);
+    }
+    else
+    {
+        qid.path = (int_64)(int_pointer)dfs_mk_file
+                (d, name, (char *)0, (int_8 *)0, 0, (void *)0, (void *)0, (void *)0);
+    }
+
+    d9r_reply_create (io, tag, qid, 0x1000);
+}
+
+/* per-connection scratch space that directory reads pack their stat
+ * records into, so a whole Rread goes out as one message */
+struct dnsfs_connection
+{
+    struct dnsfs_connection *next;
+    struct d9r_io           *io;
+    int_8                   *buffer;
+    int_32                   size;
+    struct tree             *fids;
+};
+
+static struct dnsfs_connection *connections = (struct dnsfs_connection *)0;
+
+static struct dnsfs_connection *dnsfs_connection
+    (struct d9r_io *io, int_32 size)
+{
+    struct dnsfs_connection *c;
+
+    for (c = connections; (c != (struct dnsfs_connection *)0) &&
+                          (c->io != io); c = c->next);
+
+    if (c == (struct dnsfs_connection *)0)
+    {
+        c = aalloc (sizeof (struct dnsfs_connection));
+
+        c->io       = io;
+        c->buffer   = (int_8 *)0;
+        c->size     = 0;
+        c->fids     = tree_create ();
+        c->next     = connections;
+        connections = c;
+    }
+
+    if (c->size < size)
+    {
+        if (c->buffer != (int_8 *)0)
+        {
+            afree (c->size, c->buffer);
+        }
+
+        c->buffer = aalloc (size);
+        c->size   = size;
+    }
+
+    return c;
+}
+
+/* which node each fid points at, so that dropped names stay allocated
+ * for as long as a fid refers to them */
+static void dnsfs_fid_set (struct d9r_io *io, int_32 fid, void *n)
+{
+    struct dnsfs_connection *c = dnsfs_connection (io, 0);
+    struct tree_node *node = tree_get_node (c->fids, (int_pointer)fid);
+
+    dnsfs_hold (n);
+
+    if (node != (struct tree_node *)0)
+    {
+        dnsfs_unhold (node_get_value (node));
+        tree_remove_node (c->fids, (int_pointer)fid);
+    }
+
+    tree_add_node_value (c->fids, (int_pointer)fid, n);
+}
+
+static void dnsfs_fid_clunk (struct d9r_io *io, int_32 fid)
+{
+    struct dnsfs_connection *c = dnsfs_connection (io, 0);
+    struct tree_node *node = tree_get_node (c->fids, (int_pointer)fid);
+
+    if (node != (struct tree_node *)0)
+    {
+        dnsfs_unhold (node_get_value (node));
+        tree_remove_node (c->fids, (int_pointer)fid);
+    }
+}
+
+static void dnsfs_fid_unhold (struct tree_node *node, void *aux)
+{
+    dnsfs_unhold (node_get_value (node));
+}
+
+static void dnsfs_connection_close (struct d9r_io *io)
+{
+    struct dnsfs_connection **p = &connections, *c;
+
+    while ((c = *p) != (struct dnsfs_connection *)0)
+    {
+        if (c->io == io)
+        {
+            *p = c->next;
+
+            if (c->buffer != (int_8 *)0)
+            {
+                afree (c->size, c->buffer);
+            }
+
+            tree_map (c->fids, dnsfs_fid_unhold, (void *)0);
+            tree_destroy (c->fids);
+
+            afree (sizeof (struct dnsfs_connection), c);
+        }
+        else
+        {
+            p = &(c->next);
+        }
+    }
+}
+
+static sexpr dnsfs_trace_sx (struct dnsfs_trace *t)
+{
+    sexpr r = sx_end_of_list;
+    int_64 ready = t->received;
 
-    if (perm & DMDIR)
+    if (t->replied == 0)
     {
-        struct dfs_directory *d_dir = dfs_mk_directory (d, name);
-
-        d_dir->c.mode     = 0550;
-        d_dir->c.uid      = "dnsfs";
-        d_dir->c.gid      = "dnsfs";
+        r = cons (cons (sym_pending, sx_end_of_list), r);
+    }
+    else
+    {
+        r = cons (dnsfs_pair (sym_reply, t->replied
+                              - ((t->resolve_end != 0) ? t->resolve_end
+                                                       : t->received)), r);
+    }
 
-	dnsfs_address_lookup (name, d_dir);
+    if (t->resolve_start != 0)
+    {
+        ready = t->resolve_start;
 
-        qid.type = QTDIR;
-        qid.path = (int_64)(int_pointer)d_dir;
+        if (t->resolve_end != 0)
+        {
+            r = cons (dnsfs_pair (sym_resolver,
+                                  t->resolve_end - t->resolve_start), r);
+        }
     }
-    else if (perm & DMSYMLINK)
+    else if (t->resolve_end != 0)
     {
-        qid.type = QTLINK;
-        qid.path = (int_64)(int_pointer)dfs_mk_symlink(d, name, ext);
+        ready = t->resolve_end;
     }
-    else if (perm & DMSOCKET)
+
+    if (ready != t->received)
     {
-        qid.path = (int_64)(int_pointer)dfs_mk_socket(d, name);
+        r = cons (dnsfs_pair (sym_queue, ready - t->received), r);
     }
-    else if (perm & DMNAMEDPIPE)
+
+    return cons (sym_trace,
+           cons (make_integer (t->sequence),
+           cons ((t->op == dt_walk)   ? sym_walk :
+                 (t->op == dt_create) ? sym_create : sym_read,
+           cons (make_string (t->name),
+           cons (make_integer (t->received), r)))));
+}
+
+/* the ring keeps changing, so each fid reads from a snapshot that is
+ * taken whenever it starts over at offset 0 */
+struct dnsfs_trace_snapshot
+{
+    struct dnsfs_trace_snapshot *next;
+    struct d9r_io               *io;
+    int_32                       fid;
+    struct io                   *trace;
+    struct sexpr_io             *trace_sx;
+};
+
+static struct dnsfs_trace_snapshot *trace_snapshots
+    = (struct dnsfs_trace_snapshot *)0;
+
+static void on_trace_read
+    (struct d9r_io *io, int_16 tag, struct dfs_file *f, int_64 offset,
+     int_32 length)
+{
+    struct dnsfs_trace_snapshot *c;
+
+    for (c = trace_snapshots; (c != (struct dnsfs_trace_snapshot *)0) &&
+                              ((c->io != io) || (c->fid != read_fid));
+         c = c->next);
+
+    if (c == (struct dnsfs_trace_snapshot *)0)
     {
-        qid.path = (int_64)(int_pointer)dfs_mk_pipe(d, name);
+        c = aalloc (sizeof (struct dnsfs_trace_snapshot));
+
+        c->io           = io;
+        c->fid          = read_fid;
+        c->trace        = (struct io *)0;
+        c->trace_sx     = (struct sexpr_io *)0;
+        c->next         = trace_snapshots;
+        trace_snapshots = c;
     }
-    else if (perm & DMDEVICE)
+
+    if ((offset == 0) || (c->trace_sx == (struct sexpr_io *)0))
     {
-        int_16 majour = 0, minor = 0, i = 1;
+        int_32 sequence = trace_sequence - DNSFS_TRACE_SIZE;
 
-        if ((ext == (char *)0) || (ext[0] == (char)0) || (ext[1] == (char)0) ||
-            ((ext[0] != 'c') && (ext[0] != 'b')))
+        if (c->trace_sx != (struct sexpr_io *)0)
         {
-            d9r_reply_error (io, tag, "Invalid Tcreate Message.", P9_EDONTCARE);
-            return;
+            sx_close_io (c->trace_sx);
         }
 
-        while (ext[i] == ' ') i++;
+        c->trace    = io_open_special ();
+        c->trace_sx = sx_open_o (c->trace);
 
-        while (ext[i] && (ext[i] != ' '))
+        if (sequence < 0)
         {
-            majour *= 10;
-            majour += (char)(ext[i] - '0');
-            i++;
+            sequence = 0;
         }
 
-        while (ext[i] == ' ') i++;
-
-        while (ext[i])
+        while (sequence < trace_sequence)
         {
-            minor *= 10;
-            minor += (char)(ext[i] - '0');
-            i++;
-        }
+            struct dnsfs_trace *t = dnsfs_trace_get (++sequence);
 
-        qid.path = (int_64)(int_pointer)dfs_mk_device
-                (d, name,
-                 (ext[0] == 'b') ? dfs_block_device : dfs_character_device,
-                  majour, minor);
+            if (t != (struct dnsfs_trace *)0)
+            {
+                sx_write (c->trace_sx, dnsfs_trace_sx (t));
+            }
+        }
     }
-    else
+
+    dnsfs_reply_buffer (io, tag, offset, length, c->trace);
+}
+
+/* drops the snapshots of one fid, or of all fids of io if all is set */
+static void dnsfs_trace_close (struct d9r_io *io, int_32 fid, char all)
+{
+    struct dnsfs_trace_snapshot **p = &trace_snapshots, *c;
+
+    while ((c = *p) != (struct dnsfs_trace_snapshot *)0)
     {
-        qid.path = (int_64)(int_pointer)dfs_mk_file
-                (d, name, (char *)0, (int_8 *)0, 0, (void *)0, (void *)0, (void *)0);
-    }
+        if ((c->io == io) && (all || (c->fid == fid)))
+        {
+            *p = c->next;
 
-    d9r_reply_create (io, tag, qid, 0x1000);
+            if (c->trace_sx != (struct sexpr_io *)0)
+            {
+                sx_close_io (c->trace_sx);
+            }
+
+            afree (sizeof (struct dnsfs_trace_snapshot), c);
+        }
+        else
+        {
+            p = &(c->next);
+        }
+    }
 }
 
 struct Tread_dir_map
 {
     int_32 index;
-    int_16 tag;
-    char replied;
+    int_32 consumed;
+    int_32 length;
+    int_32 used;
+    char full;
+    int_8 *buffer;
     struct d9r_io *io;
+    struct dfs_directory *dir;
 };
 
-static void Tread_dir (struct tree_node *node, void *v)
+/* duat encodes every record into a buffer of its own, which keeps the
+ * 9P dialect its business; the record is copied into the reply */
+static char dnsfs_stat_append
+    (struct Tread_dir_map *m, struct dfs_node_common *c, char *name)
 {
-    struct Tread_dir_map *m = (struct Tread_dir_map *)v;
+    int_8 *bb;
+    int_16 slen = 0;
+    int_32 modex = 0;
+    struct d9r_qid qid = { 0, 1, (int_64)(int_pointer)c };
+
+    switch (c->type)
+    {
+        case dft_directory:
+            qid.type = QTDIR;
+            modex = DMDIR;
+            break;
+        case dft_symlink:
+            qid.type = QTLINK;
+            modex = DMSYMLINK;
+            break;
+        case dft_device:
+            modex = DMDEVICE;
+            break;
+        case dft_socket:
+            modex = DMSOCKET;
+            break;
+        case dft_pipe:
+            modex = DMNAMEDPIPE;
+            break;
+        case dft_file:
+            break;
+    }
+
+    slen = d9r_prepare_stat_buffer
+            (m->io, &bb, 0, 0, &qid, modex | c->mode, c->atime, c->mtime,
+             c->length, name, c->uid, c->gid, c->muid, (char *)0);
 
-    if (m->index == 0)
+    if ((m->used > 0) && ((m->used + slen) > m->length))
     {
-        struct dfs_node_common *c
-                = (struct dfs_node_common *)node_get_value (node);
+        afree (slen, bb);
+        m->full = (char)1;
+        return (char)0;
+    }
 
-        if (c != (struct dfs_node_common *)0)
-        {
-            int_8 *bb;
-            int_16 slen = 0;
-            int_32 modex = 0;
-            struct d9r_qid qid = { 0, 1, (int_64)(int_pointer)c };
+    memcpy (m->buffer + m->used, bb, slen);
+    m->used += slen;
+    afree (slen, bb);
 
-            switch (c->type)
-            {
-                case dft_directory:
-                    qid.type = QTDIR;
-                    modex = DMDIR;
-                    break;
-                case dft_symlink:
-                    qid.type = QTLINK;
-                    modex = DMSYMLINK;
-                    break;
-                case dft_device:
-                    modex = DMDEVICE;
-                    break;
-                case dft_socket:
-                    modex = DMSOCKET;
-                    break;
-                case dft_pipe:
-                    modex = DMNAMEDPIPE;
-                    break;
-                case dft_file:
-                    break;
-            }
+    return (char)1;
+}
+
+static void Tread_dir (struct tree_node *node, void *v)
+{
+    struct Tread_dir_map *m = (struct Tread_dir_map *)v;
+    struct dfs_node_common *c;
 
-            slen = d9r_prepare_stat_buffer
-                    (m->io, &bb, 0, 0, &qid, modex | c->mode, c->atime,
-                     c->mtime, c->length, c->name, c->uid, c->gid, c->muid,
-                     (char *)0);
-            d9r_reply_read (m->io, m->tag, slen, bb);
-            afree (slen, bb);
+    if (m->index > 0)
+    {
+        m->index--;
+        return;
+    }
 
-            m->replied = (char)1;
-        }
+    if (m->full)
+    {
+        return;
     }
 
-    m->index--;
+    c = (struct dfs_node_common *)node_get_value (node);
+
+    /* the only directory linked in somewhere other than its parent is a
+     * name's, as @ in its zone dir */
+    if ((c == (struct dfs_node_common *)0) ||
+        dnsfs_stat_append (m, c,
+            ((c->type == dft_directory) &&
+             (((struct dfs_directory *)c)->parent != m->dir))
+                ? DNSFS_LABEL_FILES : c->name))
+    {
+        m->consumed++;
+    }
 }
 
-static void Tread (struct d9r_io *io, int_16 tag, int_32 fid, int_64 offset, int_32 length)
+static void dnsfs_read (struct d9r_io *io, int_16 tag, int_32 fid, int_64 offset, int_32 length)
 {
     struct d9r_fid_metadata *md = d9r_fid_metadata (io, fid);
     struct dfs_node_common *c = md->aux;
@@ -552,50 +4268,42 @@ static void Tread (struct d9r_io *io, int_16 tag, int_32 fid, int_64 offset, int
         case dft_directory:
             {
                 struct dfs_directory *dir = (struct dfs_directory *)c;
+                struct dnsfs_connection *conn;
+                struct Tread_dir_map m
+                        = { .index = 0, .consumed = 0, .length = length,
+                            .used = 0, .full = (char)0, .io = io,
+                            .dir = dir };
+
                 if (offset == (int_64)0) md->index = 0;
 
-                if (md->index == 0)
+                /* room for at least one record even if the client asked
+                 * for less, as the old one-record-per-read code allowed */
+                conn = dnsfs_connection
+                        (io, (length > 0x10000) ? length : 0x10000);
+                m.buffer = conn->buffer;
+
+                if ((md->index == 0) &&
+                    dnsfs_stat_append (&m, &(dir->c), "."))
                 {
-                    int_8 *bb;
-                    struct d9r_qid qid = { QTDIR, 1, (int_64)(int_pointer)c };
-                    int_16 slen = d9r_prepare_stat_buffer
-                            (io, &bb, 0, 0, &qid, DMDIR | dir->c.mode,
-                             dir->c.atime, dir->c.mtime, dir->c.length, ".",
-                             dir->c.uid, dir->c.gid, dir->c.muid, (char *)0);
-                    d9r_reply_read (io, tag, slen, bb);
-                    afree (slen, bb);
+                    (md->index)++;
                 }
-                else if (md->index == 1)
+
+                if ((md->index == 1) && !m.full &&
+                    dnsfs_stat_append (&m, &(dir->parent->c), ".."))
                 {
-                    int_16 slen;
-                    int_8 *bb;
-                    struct d9r_qid qid = { QTDIR, 1, (int_64)(int_pointer)c };
-
-                    dir = dir->parent;
-
-                    slen = d9r_prepare_stat_buffer
-                            (io, &bb, 0, 0, &qid, DMDIR | dir->c.mode,
-                             dir->c.atime, dir->c.mtime, dir->c.length, "..",
-                             dir->c.uid, dir->c.gid, dir->c.muid, (char *)0);
-                    d9r_reply_read (io, tag, slen, bb);
-                    afree (slen, bb);
+                    (md->index)++;
                 }
-                else
-                {
-                    struct Tread_dir_map m
-                            = { .tag = tag, .replied = (char)0, .io = io };
 
+                if ((md->index >= 2) && !m.full)
+                {
                     m.index = md->index - 2;
 
                     tree_map (dir->nodes, Tread_dir, (void *)&m);
 
-                    if (m.replied == (char)0)
-                    {
-                        d9r_reply_read (io, tag, 0, (int_8 *)0);
-                    }
+                    md->index += m.consumed;
                 }
 
-                (md->index)++;
+                d9r_reply_read (io, tag, m.used, m.buffer);
             }
             break;
         case dft_file:
@@ -612,6 +4320,7 @@ static void Tread (struct d9r_io *io, int_16 tag, int_32 fid, int_64 offset, int
                 }
                 else
                 {
+                    read_fid = fid;
                     file->on_read (io, tag, file, offset, length);
                 }
             }
@@ -622,6 +4331,22 @@ static void Tread (struct d9r_io *io, int_16 tag, int_32 fid, int_64 offset, int
     }
 }
 
+static void Tcreate (struct d9r_io *io, int_16 tag, int_32 fid, char *name, int_32 perm, int_8 mode, char *ext)
+{
+    dnsfs_trace_begin (dt_create, tag, name);
+    dnsfs_create (io, tag, fid, name, perm, mode, ext);
+    dnsfs_trace_end ();
+}
+
+static void Tread (struct d9r_io *io, int_16 tag, int_32 fid, int_64 offset, int_32 length)
+{
+    struct dfs_node_common *c = d9r_fid_metadata (io, fid)->aux;
+
+    dnsfs_trace_begin (dt_read, tag, c->name);
+    dnsfs_read (io, tag, fid, offset, length);
+    dnsfs_trace_end ();
+}
+
 static void Twrite (struct d9r_io *io, int_16 tag, int_32 fid, int_64 offset, int_32 count, int_8 *data)
 {
     struct d9r_fid_metadata *md = d9r_fid_metadata (io, fid);
@@ -656,10 +4381,33 @@ static void Twstat
     d9r_reply_wstat(io, tag); /* stub reply with 'yes' */
 }
 
+/* a flushed Tcreate or Twalk that waits for a lookup must never be
+ * answered, as its tag may be reused right after the Rflush */
+static void Tflush (struct d9r_io *io, int_16 tag, int_16 oldtag)
+{
+    dnsfs_cancel_waiters (io, oldtag, 0);
+
+    d9r_reply_flush (io, tag);
+}
+
+static void Tclunk (struct d9r_io *io, int_16 tag, int_32 fid)
+{
+    dnsfs_fid_clunk (io, fid);
+    dnsfs_dump_close (io, fid, 0);
+    dnsfs_trace_close (io, fid, 0);
+
+    d9r_reply_clunk (io, tag);
+}
+
 static void Cclose (struct d9r_io *io)
 {
     struct dfs *fs = (struct dfs *)io->aux;
 
+    dnsfs_cancel_waiters (io, 0, 1);
+    dnsfs_dump_close (io, 0, 1);
+    dnsfs_trace_close (io, 0, 1);
+    dnsfs_connection_close (io);
+
     if (fs->close != (void *)0)
     {
         fs->close (io, fs->aux);
@@ -676,6 +4424,8 @@ static void initialise_io (struct d9r_io *io, struct dfs *fs)
     io->Tread   = Tread;
     io->Twrite  = Twrite;
     io->Twstat  = Twstat;
+    io->Tclunk  = Tclunk;
+    io->Tflush  = Tflush;
     io->close   = Cclose;
     io->aux     = (void *)fs;
 
@@ -725,15 +4475,179 @@ static void multiplex_add_d9s_stdio_internal (struct dfs *fs)
     initialise_io (io, fs);
 }
 
+static char dnsfs_bytes_argument (sexpr sx, unsigned char *a, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++, sx = cdr (sx))
+    {
+        if (!consp (sx) || !integerp (car (sx)) ||
+            (sx_integer (car (sx)) < 0) || (sx_integer (car (sx)) > 255))
+        {
+            return 0;
+        }
+
+        a[i] = (unsigned char)sx_integer (car (sx));
+    }
+
+    return eolp (sx);
+}
+
+/* (entry "name" ttl (ip4 a b c d) (ip6 ...) ...), as read from dnsfs/dump */
+static const char *dnsfs_import_entry (sexpr args)
+{
+    unsigned char a4[DNSFS_MAX_ADDRESSES][4];
+    unsigned char a6[DNSFS_MAX_ADDRESSES][16];
+    unsigned int n4 = 0, n6 = 0;
+    struct dnsfs_entry *e;
+    char name[DNSFS_NAME_SIZE];
+    int_64 ttl, now = dnsfs_now ();
+    sexpr c;
+
+    if (!consp (args) || !stringp (car (args)) ||
+        !consp (cdr (args)) || !integerp (car (cdr (args))))
+    {
+        return "Expected a name and a TTL.";
+    }
+
+    ttl = sx_integer (car (cdr (args)));
+
+    if (!dnsfs_canonical_name (name, sx_string (car (args))) ||
+        (ttl <= 0) || (ttl > 0x7fffffff))
+    {
+        return "Invalid name or TTL.";
+    }
+
+    for (c = cdr (cdr (args)); consp (c); c = cdr (c))
+    {
+        sexpr r = car (c);
+
+        if (!consp (r))
+        {
+            return "Invalid record.";
+        }
+
+        if (truep (equalp (car (r), sym_ip4)) && (n4 < DNSFS_MAX_ADDRESSES) &&
+            dnsfs_bytes_argument (cdr (r), a4[n4], 4))
+        {
+            n4++;
+        }
+        else if (truep (equalp (car (r), sym_ip6)) &&
+                 (n6 < DNSFS_MAX_ADDRESSES) &&
+                 dnsfs_bytes_argument (cdr (r), a6[n6], 16))
+        {
+            n6++;
+        }
+        else
+        {
+            return "Invalid record.";
+        }
+    }
+
+    if ((e = dnsfs_entry_get (name)) == (struct dnsfs_entry *)0)
+    {
+        return "Reserved name.";
+    }
+
+    if ((e->lookup == (struct dnsfs_lookup *)0) &&
+        (e->expires < (now + ttl * 1000000)))
+    {
+        dnsfs_entry_set_addresses
+            (e, n4, (unsigned char *)a4, n6, (unsigned char *)a6,
+             (int_32)ttl, now);
+    }
+
+    return (const char *)0;
+}
+
+/* a dump is imported one (entry ...) at a time, so the status counts
+ * them; the last command alone would hide a rejected one in between */
+static const char *dnsfs_import (sexpr args)
+{
+    const char *error = dnsfs_import_entry (args);
+
+    if (error == (const char *)0)
+    {
+        imported++;
+    }
+    else
+    {
+        import_rejected++;
+    }
+
+    return error;
+}
+
+static void dnsfs_status (const char *command, const char *error)
+{
+    status_command = command;
+    status_error   = error;
+}
+
 static void mx_sx_ctl_queue_read (sexpr sx, struct sexpr_io *io, void *aux)
 {
     if (consp(sx))
     {
         sexpr sxcar = car (sx);
+        sexpr sxcdr = cdr (sx);
+
         if (truep(equalp(sxcar, sym_disable)))
         {
             exit (0);
         }
+        else if (truep(equalp(sxcar, sym_nop)))
+        {
+            dnsfs_status ("nop", (const char *)0);
+        }
+        else if (truep(equalp(sxcar, sym_invalidate)))
+        {
+            dnsfs_status ("invalidate",
+                          dnsfs_subtree (sxcdr, dnsfs_entry_invalidate));
+        }
+        else if (truep(equalp(sxcar, sym_refresh)))
+        {
+            dnsfs_status ("refresh", dnsfs_refresh (sxcdr));
+        }
+        else if (truep(equalp(sxcar, sym_flush)))
+        {
+            dnsfs_status ("flush", dnsfs_flush (sxcdr));
+        }
+        else if (truep(equalp(sxcar, sym_ttl_floor)))
+        {
+            dnsfs_status ("ttl-floor", dnsfs_set_ttl (sxcdr, 0));
+        }
+        else if (truep(equalp(sxcar, sym_ttl_ceiling)))
+        {
+            dnsfs_status ("ttl-ceiling", dnsfs_set_ttl (sxcdr, 1));
+        }
+        else if (truep(equalp(sxcar, sym_cache_limit)))
+        {
+            dnsfs_status ("cache-limit", dnsfs_set_cache_limit (sxcdr));
+        }
+        else if (truep(equalp(sxcar, sym_trace_sample)))
+        {
+            dnsfs_status ("trace-sample", dnsfs_set_trace_sample (sxcdr));
+        }
+        else if (truep(equalp(sxcar, sym_prefetch)))
+        {
+            dnsfs_status ("prefetch", dnsfs_set_flag (sxcdr, &o_prefetch));
+        }
+        else if (truep(equalp(sxcar, sym_serve_stale)))
+        {
+            dnsfs_status ("serve-stale", dnsfs_set_serve_stale (sxcdr));
+        }
+        else if (truep(equalp(sxcar, sym_upstreams)))
+        {
+            dnsfs_status ("upstreams", dnsfs_set_upstreams (sxcdr));
+        }
+        else if (truep(equalp(sxcar, sym_entry)))
+        {
+            dnsfs_status ("entry", dnsfs_import (sxcdr));
+        }
+        else
+        {
+            dnsfs_status ("unknown", "Unknown command.");
+        }
     }
 }
 
@@ -758,7 +4672,10 @@ int main (int argc, char **argv, char **environ)
     char use_stdio = 0;
     char *use_socket = (char *)0;
     char next_socket = 0;
+    char next_resolver = 0;
+    char next_probe = 0;
     char o_foreground = 0;
+    char o_zones = 0;
 
     multiplex_io();
 
@@ -775,7 +4692,10 @@ int main (int argc, char **argv, char **environ)
                 {
                     case 'o': use_stdio = 1; break;
                     case 's': next_socket = 1; break;
+                    case 'r': next_resolver = 1; break;
                     case 'f': o_foreground = 1; break;
+                    case 't': o_zones = 1; break;
+                    case 'b': next_probe = 1; break;
                     default:
                         print_help();
                 }
@@ -789,6 +4709,26 @@ int main (int argc, char **argv, char **environ)
             next_socket = 0;
             continue;
         }
+
+        if (next_resolver)
+        {
+            dnsfs_add_upstream (argv[i]);
+            next_resolver = 0;
+            continue;
+        }
+
+        if (next_probe)
+        {
+            probe_port = atoi (argv[i]);
+            next_probe = 0;
+
+            if ((probe_port <= 0) || (probe_port > 0xffff))
+            {
+                print_help();
+            }
+
+            continue;
+        }
     }
 
     if ((use_socket == (char *)0) && (use_stdio == 0))
@@ -796,12 +4736,39 @@ int main (int argc, char **argv, char **environ)
         print_help();
     }
 
+    entries = tree_create ();
+    entry_dirs = tree_create ();
+    labels.children = tree_create ();
+    probes  = tree_create ();
+    holds   = tree_create ();
+    dead    = tree_create ();
+
     fs = dfs_create ((void *)0, (void *)0);
     fs->root->c.mode |= 0111;
+    names_root = fs->root;
+
+    if (o_zones)
+    {
+        zones = dfs_mk_directory (fs->root, "zones");
+        zones->c.mode = 0550;
+        zones->c.uid  = "dnsfs";
+        zones->c.gid  = "dnsfs";
+        labels.dir    = zones;
+    }
 
     struct dfs_directory *d_dnsfs = dfs_mk_directory (fs->root, "dnsfs");
     struct dfs_file *d_dnsfs_ctl  = dfs_mk_file (d_dnsfs, "control", (char *)0,
             (int_8 *)"(nop)\n", 6, (void *)0, (void *)0, on_control_write);
+    struct dfs_file *d_dnsfs_ups  = dfs_mk_file (d_dnsfs, "upstreams",
+            (char *)0, (int_8 *)0, 0, (void *)0, on_upstreams_read, (void *)0);
+    struct dfs_file *d_dnsfs_que  = dfs_mk_file (d_dnsfs, "queue",
+            (char *)0, (int_8 *)0, 0, (void *)0, on_queue_read, (void *)0);
+    struct dfs_file *d_dnsfs_sta  = dfs_mk_file (d_dnsfs, "status",
+            (char *)0, (int_8 *)0, 0, (void *)0, on_status_read, (void *)0);
+    struct dfs_file *d_dnsfs_dmp  = dfs_mk_file (d_dnsfs, "dump",
+            (char *)0, (int_8 *)0, 0, (void *)0, on_dump_read, (void *)0);
+    struct dfs_file *d_dnsfs_trc  = dfs_mk_file (d_dnsfs, "trace",
+            (char *)0, (int_8 *)0, 0, (void *)0, on_trace_read, (void *)0);
 
     queue_io = io_open_special();
     d_dnsfs->c.mode     = 0550;
@@ -810,6 +4777,21 @@ int main (int argc, char **argv, char **environ)
     d_dnsfs_ctl->c.mode = 0660;
     d_dnsfs_ctl->c.uid  = "dnsfs";
     d_dnsfs_ctl->c.gid  = "dnsfs";
+    d_dnsfs_ups->c.mode = 0440;
+    d_dnsfs_ups->c.uid  = "dnsfs";
+    d_dnsfs_ups->c.gid  = "dnsfs";
+    d_dnsfs_que->c.mode = 0440;
+    d_dnsfs_que->c.uid  = "dnsfs";
+    d_dnsfs_que->c.gid  = "dnsfs";
+    d_dnsfs_sta->c.mode = 0440;
+    d_dnsfs_sta->c.uid  = "dnsfs";
+    d_dnsfs_sta->c.gid  = "dnsfs";
+    d_dnsfs_dmp->c.mode = 0440;
+    d_dnsfs_dmp->c.uid  = "dnsfs";
+    d_dnsfs_dmp->c.gid  = "dnsfs";
+    d_dnsfs_trc->c.mode = 0440;
+    d_dnsfs_trc->c.uid  = "dnsfs";
+    d_dnsfs_trc->c.gid  = "dnsfs";
 
     queue = sx_open_i (queue_io);
 
@@ -819,6 +4801,8 @@ int main (int argc, char **argv, char **environ)
 
     multiplex_d9s_internal();
 
+    multiplex_resolver();
+
     if (use_stdio)
     {
         multiplex_add_d9s_stdio_internal (fs);